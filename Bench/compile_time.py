@@ -0,0 +1,176 @@
+#!/usr/bin/env python
+"""
+Compile-time benchmark of the passes
+
+Runs each pass through opt on synthetic modules from generate.py, and reports
+the wall time, the peak resident set size of opt and the growth of the number
+of instructions, as JSON or CSV, so that the scaling of the passes can be
+tracked from one revision to another.
+
+Each size option takes a comma-separated list of values, and every
+combination is measured. The `none` pass only parses and prints the module,
+which is the baseline of the others.
+"""
+
+from __future__ import print_function, division
+
+import argparse
+import csv
+import itertools
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import generate
+
+# modules to load, relative to the build directory, and options of each pass
+PASSES = {
+    'none': ([], []),
+    'mba': (['MBA/LLVMMBA'], ['-mba']),
+    'reachable-integer-values': (
+        ['ReachableIntegerValues/LLVMReachableIntegerValues'],
+        ['-reachable-integer-values']),
+    'duplicate-bb': (
+        ['ReachableIntegerValues/LLVMReachableIntegerValues',
+         'DuplicateBB/LLVMDuplicateBB'],
+        ['-duplicate-bb']),
+}
+
+FIELDS = ['pass', 'functions', 'blocks', 'depth', 'values',
+          'instructions_before', 'instructions_after', 'growth',
+          'wall_time_min', 'wall_time_median', 'peak_rss_kib']
+
+INSTRUCTION = re.compile(r'^  [^ ;\]]')
+
+
+def count_instructions(path):
+    with open(path) as ir:
+        return sum(1 for line in ir if INSTRUCTION.match(line))
+
+
+def run(command):
+    """Run command, and return its wall time and its peak RSS in KiB"""
+    start = time.time()
+    process = subprocess.Popen(command)
+    _, status, usage = os.wait4(process.pid, 0)
+    elapsed = time.time() - start
+    process.returncode = status
+    if status:
+        raise RuntimeError('command failed: ' + ' '.join(command))
+    # bytes on Darwin, kilobytes elsewhere
+    rss = usage.ru_maxrss
+    if sys.platform == 'darwin':
+        rss //= 1024
+    return elapsed, rss
+
+
+def median(values):
+    values = sorted(values)
+    middle = len(values) // 2
+    if len(values) % 2:
+        return values[middle]
+    return (values[middle - 1] + values[middle]) / 2
+
+
+def measure(args, workdir, name, sizes):
+    functions, blocks, depth, values = sizes
+    source = os.path.join(workdir, 'input.ll')
+    output = os.path.join(workdir, 'output.ll')
+    with open(source, 'w') as out:
+        generate.generate(out, functions, blocks, depth, values, args.seed)
+
+    modules, options = PASSES[name]
+    command = [args.opt]
+    for module in modules:
+        command += ['-load', os.path.join(args.bindir, module + args.mod_ext)]
+    command += options + [source, '-S', '-o', output]
+
+    times, rss = [], 0
+    for _ in range(args.repeat):
+        elapsed, peak = run(command)
+        times.append(elapsed)
+        rss = max(rss, peak)
+
+    before = count_instructions(source)
+    after = count_instructions(output)
+    return {
+        'pass': name,
+        'functions': functions,
+        'blocks': blocks,
+        'depth': depth,
+        'values': values,
+        'instructions_before': before,
+        'instructions_after': after,
+        'growth': after / before if before else 1.,
+        'wall_time_min': min(times),
+        'wall_time_median': median(times),
+        'peak_rss_kib': rss,
+    }
+
+
+def int_list(value):
+    return [int(item) for item in value.split(',')]
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('-opt', default='opt', help='path to opt')
+    parser.add_argument('-bindir', default='.',
+                        help='build directory holding the modules')
+    parser.add_argument('-mod-ext', dest='mod_ext', default='.so',
+                        help='extension of the modules')
+    parser.add_argument('-passes', default=','.join(sorted(PASSES)),
+                        help='comma-separated list of passes among ' +
+                        ', '.join(sorted(PASSES)))
+    parser.add_argument('-functions', type=int_list, default=[10, 100])
+    parser.add_argument('-blocks', type=int_list, default=[10, 100])
+    parser.add_argument('-depth', type=int_list, default=[5, 50])
+    parser.add_argument('-values', type=int_list, default=[10])
+    parser.add_argument('-seed', type=int, default=0)
+    parser.add_argument('-repeat', type=int, default=3,
+                        help='runs of each measure')
+    parser.add_argument('-format', choices=['json', 'csv'], default='json')
+    parser.add_argument('-o', dest='output', default='-')
+    args = parser.parse_args()
+
+    names = args.passes.split(',')
+    for name in names:
+        if name not in PASSES:
+            parser.error('unknown pass: ' + name)
+
+    results = []
+    workdir = tempfile.mkdtemp(prefix='bench-')
+    try:
+        for sizes in itertools.product(args.functions, args.blocks,
+                                       args.depth, args.values):
+            for name in names:
+                result = measure(args, workdir, name, sizes)
+                print('{pass}: {functions} functions, {blocks} blocks, '
+                      'depth {depth}, {values} values: {wall_time_median:.3f}s, '
+                      '{peak_rss_kib} KiB, growth {growth:.2f}'
+                      .format(**result), file=sys.stderr)
+                results.append(result)
+    finally:
+        shutil.rmtree(workdir)
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    try:
+        if args.format == 'json':
+            json.dump(results, out, indent=2, sort_keys=True)
+            out.write('\n')
+        else:
+            writer = csv.DictWriter(out, FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+    finally:
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
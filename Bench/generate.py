@@ -0,0 +1,112 @@
+#!/usr/bin/env python
+"""
+Synthetic LLVM IR generator
+
+Generates a module whose shape is controlled from the command line: the
+number of functions, of basic blocks per function, the depth of the dominator
+tree and the number of integer values defined in each block.
+
+Each block has a single predecessor, so the control flow graph is its own
+dominator tree. The first blocks form a chain as deep as requested, the others
+hang from random blocks of that chain. Blocks compute integer values from the
+values of their dominators, and branch to their children through a switch.
+
+The output only depends on the options, including the seed.
+"""
+
+from __future__ import print_function
+
+import argparse
+import random
+import sys
+
+OPCODES = ['add', 'sub', 'mul', 'xor', 'and', 'or', 'shl', 'lshr']
+
+
+def generate_function(out, rng, name, blocks, depth, values):
+    depth = max(1, min(depth, blocks))
+
+    # parent of each block in the dominator tree, and depth of each block
+    parents = [None]
+    depths = [0]
+    for index in range(1, blocks):
+        if index < depth:
+            parent = index - 1
+        else:
+            parent = rng.randrange(0, depth - 1) if depth > 1 else 0
+        parents.append(parent)
+        depths.append(depths[parent] + 1)
+    children = [[] for _ in range(blocks)]
+    for index in range(1, blocks):
+        children[parents[index]].append(index)
+
+    print('define i32 @{}(i32 %a, i32 %b) {{'.format(name), file=out)
+    available = {}
+    for index in range(blocks):
+        label = 'entry' if index == 0 else 'bb{}'.format(index)
+        if index:
+            print('', file=out)
+        print('{}:'.format(label), file=out)
+
+        reachable = list(available[parents[index]]) if index else ['%a', '%b']
+        last = reachable[-1]
+        for value in range(values):
+            result = '%v{}.{}'.format(index, value)
+            opcode = rng.choice(OPCODES)
+            lhs = rng.choice(reachable)
+            if opcode in ('shl', 'lshr'):
+                rhs = str(rng.randrange(1, 31))
+            else:
+                rhs = rng.choice(reachable)
+            print('  {} = {} i32 {}, {}'.format(result, opcode, lhs, rhs),
+                  file=out)
+            reachable.append(result)
+            last = result
+        available[index] = reachable
+
+        if not children[index]:
+            print('  ret i32 {}'.format(last), file=out)
+        else:
+            cases = ' '.join('i32 {}, label %bb{}'.format(case, child)
+                             for case, child in enumerate(children[index][1:],
+                                                          1))
+            print('  switch i32 {}, label %bb{} [ {} ]'.format(
+                last, children[index][0], cases), file=out)
+    print('}', file=out)
+
+
+def generate(out, functions, blocks, depth, values, seed):
+    rng = random.Random(seed)
+    print('; generated by generate.py -functions={} -blocks={} -depth={} '
+          '-values={} -seed={}'.format(functions, blocks, depth, values, seed),
+          file=out)
+    for index in range(functions):
+        print('', file=out)
+        generate_function(out, rng, 'f{}'.format(index), blocks, depth,
+                          values)
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('-functions', type=int, default=10)
+    parser.add_argument('-blocks', type=int, default=10,
+                        help='basic blocks per function')
+    parser.add_argument('-depth', type=int, default=5,
+                        help='depth of the dominator tree')
+    parser.add_argument('-values', type=int, default=10,
+                        help='integer values defined per basic block')
+    parser.add_argument('-seed', type=int, default=0)
+    parser.add_argument('-o', dest='output', default='-')
+    args = parser.parse_args()
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    try:
+        generate(out, args.functions, args.blocks, args.depth, args.values,
+                 args.seed)
+    finally:
+        if out is not sys.stdout:
+            out.close()
+
+
+if __name__ == '__main__':
+    main()
@@ -0,0 +1,79 @@
+/*
+ * Hashing: FNV-1a, MurmurHash3 finalization and a CRC32 over a buffer of
+ * pseudo-random bytes
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE 65536
+
+static unsigned char Buffer[SIZE];
+static uint32_t CRCTable[256];
+
+static uint32_t fnv1a(unsigned char const *data, size_t size) {
+  uint32_t h = 2166136261u;
+  size_t i;
+  for (i = 0; i < size; ++i) {
+    h ^= data[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+static uint32_t murmur(unsigned char const *data, size_t size) {
+  uint32_t h = 0x9747b28c;
+  size_t i;
+  for (i = 0; i + 4 <= size; i += 4) {
+    uint32_t k = data[i] | data[i + 1] << 8 | data[i + 2] << 16 |
+                 (uint32_t)data[i + 3] << 24;
+    k *= 0xcc9e2d51;
+    k = (k << 15) | (k >> 17);
+    k *= 0x1b873593;
+    h ^= k;
+    h = (h << 13) | (h >> 19);
+    h = h * 5 + 0xe6546b64;
+  }
+  h ^= size;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+  return h;
+}
+
+static uint32_t crc32(unsigned char const *data, size_t size) {
+  uint32_t crc = 0xFFFFFFFFu;
+  size_t i;
+  for (i = 0; i < size; ++i)
+    crc = CRCTable[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+  return ~crc;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+  uint32_t state = 1, checksum = 0;
+  unsigned i, j;
+
+  for (i = 0; i < 256; ++i) {
+    uint32_t c = i;
+    for (j = 0; j < 8; ++j)
+      c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+    CRCTable[i] = c;
+  }
+  for (i = 0; i < SIZE; ++i) {
+    state = state * 1103515245u + 12345u;
+    Buffer[i] = state >> 16;
+  }
+
+  while (iterations--) {
+    checksum ^= fnv1a(Buffer, SIZE);
+    checksum += murmur(Buffer, SIZE);
+    checksum = (checksum << 1) ^ crc32(Buffer, SIZE);
+    Buffer[checksum % SIZE] ^= checksum;
+  }
+  printf("%u\n", checksum);
+  return 0;
+}
@@ -0,0 +1,59 @@
+/*
+ * Integer loops: a prefix sum, a matrix product and a bit count over arrays
+ * of pseudo-random integers
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define N 64
+
+static unsigned state = 1;
+static unsigned next(void) {
+  state ^= state << 13;
+  state ^= state >> 17;
+  state ^= state << 5;
+  return state;
+}
+
+static unsigned A[N][N], B[N][N], C[N][N];
+
+static unsigned kernel(void) {
+  unsigned i, j, k, sum = 0;
+  for (i = 0; i < N; ++i)
+    for (j = 0; j < N; ++j) {
+      A[i][j] = next() & 0xFFFF;
+      B[i][j] = next() & 0xFFFF;
+    }
+
+  for (i = 0; i < N; ++i)
+    for (j = 0; j < N; ++j) {
+      unsigned acc = 0;
+      for (k = 0; k < N; ++k)
+        acc += A[i][k] * B[k][j];
+      C[i][j] = acc;
+    }
+
+  for (i = 0; i < N; ++i)
+    for (j = 1; j < N; ++j)
+      C[i][j] += C[i][j - 1];
+
+  for (i = 0; i < N; ++i)
+    for (j = 0; j < N; ++j) {
+      unsigned v = C[i][j];
+      v = v - ((v >> 1) & 0x55555555u);
+      v = (v & 0x33333333u) + ((v >> 2) & 0x33333333u);
+      sum += (((v + (v >> 4)) & 0x0F0F0F0Fu) * 0x01010101u) >> 24;
+      sum ^= C[i][j];
+    }
+  return sum;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 1000;
+  unsigned checksum = 0;
+  while (iterations--)
+    checksum = checksum * 31 + kernel();
+  printf("%u\n", checksum);
+  return 0;
+}
@@ -0,0 +1,128 @@
+/*
+ * Branchy parser: tokenizes and evaluates arithmetic expressions from a
+ * generated text, with a recursive descent parser
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#define SIZE 16384
+
+static char Text[SIZE];
+static char const *Cursor;
+
+static void skip(void) {
+  while (*Cursor == ' ' || *Cursor == '\n')
+    ++Cursor;
+}
+
+static long expression(void);
+
+static long primary(void) {
+  long value = 0;
+  skip();
+  if (*Cursor == '(') {
+    ++Cursor;
+    value = expression();
+    skip();
+    if (*Cursor == ')')
+      ++Cursor;
+    return value;
+  }
+  if (*Cursor == '-') {
+    ++Cursor;
+    return -primary();
+  }
+  while (*Cursor >= '0' && *Cursor <= '9')
+    value = value * 10 + (*Cursor++ - '0');
+  return value;
+}
+
+static long term(void) {
+  long value = primary();
+  for (;;) {
+    skip();
+    switch (*Cursor) {
+    case '*':
+      ++Cursor;
+      value *= primary();
+      break;
+    case '/': {
+      long divisor;
+      ++Cursor;
+      divisor = primary();
+      value = divisor ? value / divisor : value;
+      break;
+    }
+    case '%': {
+      long divisor;
+      ++Cursor;
+      divisor = primary();
+      value = divisor ? value % divisor : value;
+      break;
+    }
+    default:
+      return value;
+    }
+  }
+}
+
+static long expression(void) {
+  long value = term();
+  for (;;) {
+    skip();
+    if (*Cursor == '+') {
+      ++Cursor;
+      value += term();
+    } else if (*Cursor == '-') {
+      ++Cursor;
+      value -= term();
+    } else {
+      return value;
+    }
+  }
+}
+
+// Write a random expression of at most Depth nested levels
+static char *generate(char *Out, char *End, unsigned *state, int depth) {
+  static char const Operators[] = "+-*/%";
+  int terms, i;
+  *state = *state * 1103515245u + 12345u;
+  terms = 1 + (*state >> 16) % 4;
+  for (i = 0; i < terms && End - Out > 32; ++i) {
+    *state = *state * 1103515245u + 12345u;
+    if (i)
+      Out += sprintf(Out, " %c ", Operators[(*state >> 8) % 5]);
+    if (depth && (*state >> 16) % 3 == 0) {
+      *Out++ = '(';
+      Out = generate(Out, End - 1, state, depth - 1);
+      *Out++ = ')';
+    } else {
+      Out += sprintf(Out, "%u", (*state >> 16) % 1000);
+    }
+  }
+  return Out;
+}
+
+int main(int argc, char **argv) {
+  int iterations = argc > 1 ? atoi(argv[1]) : 2000;
+  unsigned state = 1;
+  long checksum = 0;
+  char *Out = Text, *End = Text + SIZE;
+
+  while (End - Out > 256) {
+    Out = generate(Out, End - 128, &state, 6);
+    *Out++ = '\n';
+  }
+  *Out = 0;
+
+  while (iterations--) {
+    Cursor = Text;
+    while (*Cursor) {
+      checksum = checksum * 7 + expression();
+      skip();
+    }
+  }
+  printf("%ld\n", checksum);
+  return 0;
+}
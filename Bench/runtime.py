@@ -0,0 +1,212 @@
+#!/usr/bin/env python
+"""
+Runtime overhead benchmark of the passes
+
+Compiles the C kernels of the kernels directory with clang, without
+obfuscation and with each pass at several ratios, the passes being loaded in
+clang so that they run in the standard pipeline. Each binary is run a few
+times to warm up, then timed over several runs, and its output is checked
+against the one of the plain binary.
+
+The report gives, for each kernel and configuration, the median run time and
+its standard deviation, the slowdown with respect to the plain binary, and the
+size of the text section, as a table, JSON or CSV.
+"""
+
+from __future__ import print_function, division
+
+import argparse
+import csv
+import glob
+import json
+import math
+import os
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+# modules to load, relative to the build directory, and ratio option of each
+# pass
+PASSES = {
+    'mba': (['MBA/LLVMMBA'], '-mba-ratio'),
+    'duplicate-bb': (
+        ['ReachableIntegerValues/LLVMReachableIntegerValues',
+         'DuplicateBB/LLVMDuplicateBB'],
+        '-duplicate-bb-ratio'),
+}
+
+FIELDS = ['kernel', 'pass', 'ratio', 'time_median', 'time_mean', 'time_stddev',
+          'slowdown', 'text_size', 'size_ratio']
+
+
+def compile_kernel(args, source, binary, name, ratio):
+    command = [args.clang, args.opt_level, source, '-o', binary]
+    if name:
+        modules, option = PASSES[name]
+        for module in modules:
+            command += ['-Xclang', '-load', '-Xclang',
+                        os.path.join(args.bindir, module + args.mod_ext)]
+        command += ['-mllvm', '{}={}'.format(option, ratio)]
+    subprocess.check_call(command)
+
+
+def text_size(args, binary):
+    # Berkeley format: text data bss dec hex filename
+    output = subprocess.check_output([args.size, binary]).decode()
+    return int(output.splitlines()[1].split()[0])
+
+
+def run_kernel(args, binary):
+    """Return the output of binary and its run times, warm-up excluded"""
+    command = [binary] + ([str(args.iterations)] if args.iterations else [])
+    output = None
+    times = []
+    for run in range(args.warmup + args.repeat):
+        start = time.time()
+        output = subprocess.check_output(command)
+        if run >= args.warmup:
+            times.append(time.time() - start)
+    return output, times
+
+
+def statistics(times):
+    times = sorted(times)
+    middle = len(times) // 2
+    if len(times) % 2:
+        median = times[middle]
+    else:
+        median = (times[middle - 1] + times[middle]) / 2
+    mean = sum(times) / len(times)
+    variance = sum((t - mean) ** 2 for t in times) / max(1, len(times) - 1)
+    return median, mean, math.sqrt(variance)
+
+
+def float_list(value):
+    return [float(item) for item in value.split(',')]
+
+
+def print_table(results, out):
+    header = ('kernel', 'configuration', 'median (s)', 'stddev (s)',
+              'slowdown', 'text (B)', 'size')
+    rows = [header]
+    for result in results:
+        configuration = result['pass']
+        if result['ratio'] is not None:
+            configuration += ' {:g}'.format(result['ratio'])
+        rows.append((result['kernel'], configuration,
+                     '{:.4f}'.format(result['time_median']),
+                     '{:.4f}'.format(result['time_stddev']),
+                     '{:.2f}x'.format(result['slowdown']),
+                     str(result['text_size']),
+                     '{:.2f}x'.format(result['size_ratio'])))
+    widths = [max(len(row[column]) for row in rows)
+              for column in range(len(header))]
+    for row in rows:
+        print('  '.join(cell.ljust(width) if column < 2 else cell.rjust(width)
+                        for column, (cell, width)
+                        in enumerate(zip(row, widths))).rstrip(), file=out)
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description=__doc__.strip().split('\n')[0])
+    parser.add_argument('-clang', default='clang', help='path to clang')
+    parser.add_argument('-size', default=None,
+                        help='path to llvm-size, defaults to the one of clang')
+    parser.add_argument('-bindir', default='.',
+                        help='build directory holding the modules')
+    parser.add_argument('-mod-ext', dest='mod_ext', default='.so',
+                        help='extension of the modules')
+    parser.add_argument('-kernels', default=os.path.join(here, 'kernels'),
+                        help='directory holding the C kernels')
+    parser.add_argument('-passes', default=','.join(sorted(PASSES)),
+                        help='comma-separated list of passes among ' +
+                        ', '.join(sorted(PASSES)))
+    parser.add_argument('-ratios', type=float_list, default=[0.1, 0.5, 1.],
+                        help='comma-separated list of ratios')
+    parser.add_argument('-O', dest='opt_level', default='2',
+                        help='optimization level')
+    parser.add_argument('-iterations', type=int, default=0,
+                        help='iterations of each kernel, 0 for its default')
+    parser.add_argument('-warmup', type=int, default=1,
+                        help='runs before timing')
+    parser.add_argument('-repeat', type=int, default=5, help='timed runs')
+    parser.add_argument('-format', choices=['table', 'json', 'csv'],
+                        default='table')
+    parser.add_argument('-o', dest='output', default='-')
+    args = parser.parse_args()
+    args.opt_level = '-O' + args.opt_level
+    if args.size is None:
+        args.size = os.path.join(os.path.dirname(args.clang), 'llvm-size')
+        if not os.path.dirname(args.clang):
+            args.size = 'llvm-size'
+
+    names = args.passes.split(',')
+    for name in names:
+        if name not in PASSES:
+            parser.error('unknown pass: ' + name)
+    sources = sorted(glob.glob(os.path.join(args.kernels, '*.c')))
+    if not sources:
+        parser.error('no kernel in ' + args.kernels)
+
+    configurations = [(None, None)]
+    configurations += [(name, ratio) for name in names for ratio in args.ratios]
+
+    results = []
+    failed = False
+    workdir = tempfile.mkdtemp(prefix='bench-')
+    try:
+        for source in sources:
+            kernel = os.path.splitext(os.path.basename(source))[0]
+            reference = None
+            for name, ratio in configurations:
+                binary = os.path.join(workdir, '{}-{}-{}'.format(kernel, name,
+                                                                 ratio))
+                compile_kernel(args, source, binary, name, ratio)
+                output, times = run_kernel(args, binary)
+                median, mean, stddev = statistics(times)
+                size = text_size(args, binary)
+                if reference is None:
+                    reference = output, median, size
+                elif output != reference[0]:
+                    print('{}: {} {} changes the output of the kernel'
+                          .format(kernel, name, ratio), file=sys.stderr)
+                    failed = True
+                result = {
+                    'kernel': kernel,
+                    'pass': name or 'plain',
+                    'ratio': ratio,
+                    'time_median': median,
+                    'time_mean': mean,
+                    'time_stddev': stddev,
+                    'slowdown': median / reference[1],
+                    'text_size': size,
+                    'size_ratio': size / reference[2],
+                }
+                print('{kernel}: {pass} {ratio}: {time_median:.4f}s, '
+                      '{slowdown:.2f}x'.format(**result), file=sys.stderr)
+                results.append(result)
+    finally:
+        shutil.rmtree(workdir)
+
+    out = sys.stdout if args.output == '-' else open(args.output, 'w')
+    try:
+        if args.format == 'table':
+            print_table(results, out)
+        elif args.format == 'json':
+            json.dump(results, out, indent=2, sort_keys=True)
+            out.write('\n')
+        else:
+            writer = csv.DictWriter(out, FIELDS)
+            writer.writeheader()
+            writer.writerows(results)
+    finally:
+        if out is not sys.stdout:
+            out.close()
+    return 1 if failed else 0
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -15,19 +15,44 @@
 /* for stat support */
 #include "llvm/ADT/Statistic.h"
 STATISTIC(DuplicateBBCount, "The # of duplicated blocks");
+STATISTIC(DuplicateBBPHICount, "The # of PHI nodes inserted");
+STATISTIC(DuplicateBBAvoidedPHICount, "The # of PHI nodes avoided");
+STATISTIC(DuplicateBBHoistedCount,
+          "The # of conditions hoisted in a loop preheader");
+STATISTIC(DuplicateBBGrowth, "The # of instructions added");
+STATISTIC(DuplicateBBWindowCount,
+          "The # of blocks only duplicated on a window of instructions");
+STATISTIC(DuplicateBBAllocationCount,
+          "The # of times the cloning structures were reallocated");
+STATISTIC(DuplicateBBOverBudgetCount,
+          "The # of duplications skipped because of the growth budget");
+STATISTIC(DuplicateBBCacheHitCount, "The # of functions read from the cache");
+STATISTIC(DuplicateBBCacheMissCount,
+          "The # of functions missing from the cache");
 
 #include "llvm/Pass.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/ValueTracking.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/MDBuilder.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
-#include "llvm/Support/RandomNumberGenerator.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
-#include "llvm/Transforms/Utils/Cloning.h"
 
+#include "DuplicateBB.h"
 #include "ReachableIntegerValues.h"
 #include "Utils.h"
 
+#include <algorithm>
+
 // Similar to MBA's
 static llvm::cl::opt<Ratio> DuplicateBBRatio{
     "duplicate-bb-ratio",
@@ -38,176 +63,805 @@ static llvm::cl::opt<Ratio> DuplicateBBRatio{
     llvm::cl::Optional
 };
 
+// Similar to MBA's
+static llvm::cl::opt<double> DuplicateBBHotThreshold{
+    "duplicate-bb-hot-threshold",
+    llvm::cl::desc("Basic blocks executed more than <threshold> times per "
+                   "function call are hot, 0 disables profile guidance"),
+    llvm::cl::value_desc("threshold"),
+    llvm::cl::init(0.),
+    llvm::cl::Optional
+};
+static llvm::cl::opt<Ratio> DuplicateBBHotRatio{
+    "duplicate-bb-hot-ratio",
+    llvm::cl::desc("Only apply the duplicate basic block "
+                   "pass on <ratio> of the hot basic blocks"),
+    llvm::cl::value_desc("ratio"),
+    llvm::cl::init(0.),
+    llvm::cl::Optional
+};
+
+static llvm::cl::opt<bool> DuplicateBBLivePHIs{
+    "duplicate-bb-live-phis",
+    llvm::cl::desc("Only create PHI nodes for the values that are used "
+                   "outside of the duplicated basic block"),
+    llvm::cl::init(false),
+    llvm::cl::Optional
+};
+
+// Large blocks are only duplicated on a window of their instructions, so
+// that the growth of each duplication is bounded
+static llvm::cl::opt<unsigned> DuplicateBBMaxWindow{
+    "duplicate-bb-max-window",
+    llvm::cl::desc("Only duplicate a random window of at most <n> "
+                   "instructions of each basic block, 0 means no limit"),
+    llvm::cl::value_desc("n"),
+    llvm::cl::init(0),
+    llvm::cl::Optional
+};
+
+// Similar to MBA's
+static llvm::cl::opt<unsigned> DuplicateBBMaxGrowth{
+    "duplicate-bb-max-growth",
+    llvm::cl::desc("Do not grow functions by more than <percent> "
+                   "instructions, 0 means no limit"),
+    llvm::cl::value_desc("percent"),
+    llvm::cl::init(0),
+    llvm::cl::Optional
+};
+static llvm::cl::opt<unsigned> DuplicateBBMaxModuleGrowth{
+    "duplicate-bb-max-module-growth",
+    llvm::cl::desc("Do not grow the module by more than <percent> "
+                   "instructions, 0 means no limit"),
+    llvm::cl::value_desc("percent"),
+    llvm::cl::init(0),
+    llvm::cl::Optional
+};
+
+// Duplicating a block within a loop costs a compare and a branch per
+// iteration, unless the condition only depends on loop invariants
+enum LoopMode { LM_None, LM_SkipInnermost, LM_Hoist };
+static llvm::cl::opt<LoopMode> DuplicateBBLoopMode{
+    "duplicate-bb-loops",
+    llvm::cl::desc("How to handle basic blocks inside loops"),
+    llvm::cl::values(
+        clEnumValN(LM_None, "none", "Handle them as any other basic block"),
+        clEnumValN(LM_SkipInnermost, "skip-innermost",
+                   "Do not duplicate innermost loop bodies"),
+        clEnumValN(LM_Hoist, "hoist",
+                   "Use a loop invariant context value, and compute the "
+                   "condition in the loop preheader"),
+        clEnumValEnd),
+    llvm::cl::init(LM_None),
+    llvm::cl::Optional
+};
+
+// A context value defined far from the duplicated block, and not used
+// after it, has its live range extended over the region in between
+enum ContextMode { CM_Random, CM_Nearest };
+static llvm::cl::opt<ContextMode> DuplicateBBContext{
+    "duplicate-bb-context",
+    llvm::cl::desc("How to pick the context value of a basic block"),
+    llvm::cl::values(
+        clEnumValN(CM_Random, "random", "Any reachable integer value"),
+        clEnumValN(CM_Nearest, "nearest",
+                   "A value already live in the basic block, or else one "
+                   "defined by its nearest dominators"),
+        clEnumValEnd),
+    llvm::cl::init(CM_Random),
+    llvm::cl::Optional
+};
+
+// The branch between the clones is weighted when its outcome is known, and
+// the clone that is not taken is moved out of the way
+static llvm::cl::opt<bool> DuplicateBBBranchWeights{
+    "duplicate-bb-branch-weights",
+    llvm::cl::desc("Weight the branch between the clones of a basic block "
+                   "when its outcome is known, and move the other clone away"),
+    llvm::cl::init(true),
+    llvm::cl::Optional
+};
+
+// Position in the clang pipeline: running after the inliner duplicates the
+// blocks of a function once, in its final form, instead of once per caller
+static llvm::cl::opt<bool> DuplicateBBLate{
+    "duplicate-bb-late",
+    llvm::cl::desc("Run the duplicate-bb pass at the end of the clang "
+                   "pipeline, after inlining"),
+    llvm::cl::init(false),
+    llvm::cl::Optional
+};
+
+// Similar to MBA's
+static llvm::cl::opt<ObfuscationPolicy> DuplicateBBPolicy{
+    "duplicate-bb-policy",
+    llvm::cl::desc("Read the ratio of the duplicate-bb pass on each function "
+                   "from <file>"),
+    llvm::cl::value_desc("file"),
+    llvm::cl::Optional
+};
+
+// Similar to MBA's
+static llvm::cl::opt<std::string> DuplicateBBCacheDir{
+    "duplicate-bb-cache-dir",
+    llvm::cl::desc("Cache the obfuscated functions in <directory>"),
+    llvm::cl::value_desc("directory"),
+    llvm::cl::init(""),
+    llvm::cl::Optional
+};
+
 using namespace llvm;
 
 namespace {
 
+// A value computed in a basic block is only used after the block if it is
+// used by its terminator, by another block, or by a PHI node of the block
+// itself (through a loop)
+bool isLiveOut(Instruction const &Instr) {
+  BasicBlock const *BB = Instr.getParent();
+  for (User const *U : Instr.users()) {
+    auto const *UserInstr = cast<Instruction>(U);
+    if (UserInstr->getParent() != BB or isa<PHINode>(UserInstr) or
+        isa<TerminatorInst>(UserInstr))
+      return true;
+  }
+  return false;
+}
+
+// Block frequencies are used to skip hot blocks, and to spend the growth
+// budget on cold blocks first
+bool needsBlockFrequencies() {
+  return DuplicateBBHotThreshold > 0. or DuplicateBBMaxGrowth or
+         DuplicateBBMaxModuleGrowth;
+}
+
+// The # of instructions added by duplicating the instructions of a block
+// from Begin to End, End excluded: the condition and the new branches, a
+// clone of each instruction and of the terminator in each branch, a PHI node
+// per value, and the branches that split the window from the rest of the
+// block, if any
+uint64_t getDuplicationGrowth(Instruction const &Begin,
+                              Instruction const &End) {
+  BasicBlock const &BB = *Begin.getParent();
+  uint64_t Growth = 4;
+  for (BasicBlock::const_iterator IIT(&Begin), IE(&End); IIT != IE; ++IIT) {
+    ++Growth;
+    if (not IIT->getType()->isVoidTy())
+      ++Growth;
+  }
+  if (&Begin != BB.getFirstNonPHI())
+    ++Growth;
+  if (&End != BB.getTerminator())
+    ++Growth;
+  return Growth;
+}
+
+// Whether V, reachable from Begin, is already live there, as it is used by
+// Begin or a later instruction of its block, or by a block that block
+// dominates. Before holds the instructions of the block before Begin.
+bool isLiveIn(Value const *V, Instruction const &Begin,
+              SmallPtrSetImpl<Instruction const *> const &Before,
+              DominatorTree const &DT) {
+  BasicBlock const *BB = Begin.getParent();
+  for (User const *U : V->users()) {
+    auto const *UserInstr = dyn_cast<Instruction>(U);
+    if (not UserInstr)
+      continue;
+    // PHI nodes use their values at the end of the incoming blocks
+    if (auto const *Phi = dyn_cast<PHINode>(UserInstr)) {
+      for (unsigned I = 0, E = Phi->getNumIncomingValues(); I != E; ++I)
+        if (Phi->getIncomingValue(I) == V and
+            DT.dominates(BB, Phi->getIncomingBlock(I)))
+          return true;
+    } else if (DT.dominates(BB, UserInstr->getParent()) and
+               not Before.count(UserInstr)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// The # of edges of the dominator tree between BB and the definition of V,
+// arguments being defined above the entry block
+unsigned getDominatorDistance(Value const *V, BasicBlock *BB,
+                              DominatorTree const &DT) {
+  auto const *Instr = dyn_cast<Instruction>(V);
+  BasicBlock const *DefBB = Instr ? Instr->getParent() : nullptr;
+  unsigned Distance = 0;
+  for (DomTreeNode const *Node = DT.getNode(BB);
+       Node and Node->getBlock() != DefBB; Node = Node->getIDom())
+    ++Distance;
+  return Distance;
+}
+
+// The weights of the branches on `V == 0', true first, if the known bits of
+// V prove which one is taken. Otherwise nothing is assumed: program values
+// are null far more often than their width suggests, and the optimizers
+// already consider `V == 0' as taken 3 times out of 8.
+bool getIsNullWeights(Value *V, Instruction const *CxtI,
+                      DominatorTree const &DT,
+                      std::pair<uint32_t, uint32_t> &Weights) {
+  static uint32_t const MaxWeight = 1u << 20;
+  // pointer arguments are context values too, and have no scalar size
+  DataLayout const &DL = CxtI->getModule()->getDataLayout();
+  Type *Ty = V->getType();
+  unsigned BitWidth = Ty->isPointerTy() ? DL.getPointerTypeSizeInBits(Ty)
+                                        : Ty->getScalarSizeInBits();
+  APInt KnownZero(BitWidth, 0), KnownOne(BitWidth, 0);
+  computeKnownBits(V, KnownZero, KnownOne, DL, 0, nullptr, CxtI, &DT);
+  if (KnownOne != 0)
+    Weights = std::make_pair(1u, MaxWeight);
+  else if (KnownZero.isAllOnesValue())
+    Weights = std::make_pair(MaxWeight, 1u);
+  else
+    return false;
+  return true;
+}
+
 class DuplicateBB : public llvm::FunctionPass {
+  DuplicateBBPass Impl;
 
 public:
   static char ID;
-  compat::RandomNumberGenerator RNG;
 
-  DuplicateBB() : llvm::FunctionPass(ID), RNG(nullptr) {}
+  DuplicateBB() : llvm::FunctionPass(ID) {}
 
   bool doInitialization(Module &M) override {
-    RNG = M.createRNG(this);
+    Impl.initialize(M, getPassName());
     return false;
   }
 
   // Declare the analysis dependency
+  // Both analyses are updated while the CFG is modified, so they are
+  // preserved and do not need to be recomputed by the next passes, unless
+  // function bodies may be read from the cache
   void getAnalysisUsage(AnalysisUsage &Info) const override {
     Info.addRequired<ReachableIntegerValuesPass>();
+    Info.addRequired<DominatorTreeWrapperPass>();
+    if (DuplicateBBCacheDir.empty()) {
+      Info.addPreserved<ReachableIntegerValuesPass>();
+      Info.addPreserved<DominatorTreeWrapperPass>();
+    }
+    if (needsBlockFrequencies())
+      Info.addRequired<BlockFrequencyInfoWrapperPass>();
+    // Loops are only needed when they are handled specifically, then they
+    // are updated as well
+    if (DuplicateBBLoopMode != LM_None) {
+      Info.addRequired<LoopInfoWrapperPass>();
+      if (DuplicateBBCacheDir.empty())
+        Info.addPreserved<LoopInfoWrapperPass>();
+    }
   }
 
   bool runOnFunction(Function &F) override {
+    // Only queried before the CFG is modified
+    BlockFrequencyInfo const *BFI =
+        needsBlockFrequencies()
+            ? &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI()
+            : nullptr;
+
+    LoopInfo *LI = DuplicateBBLoopMode != LM_None
+                       ? &getAnalysis<LoopInfoWrapperPass>().getLoopInfo()
+                       : nullptr;
+
+    return Impl.runOnFunction(
+        F, getAnalysis<ReachableIntegerValuesPass>().getRIV(),
+        getAnalysis<DominatorTreeWrapperPass>().getDomTree(), BFI, LI);
+  }
+};
+}
 
-    double const Ratio = DuplicateBBRatio.getValue().getRatio();
-
-    std::uniform_real_distribution<double> Dist(0., 1.);
-
-    // We're going to modify the CFG, so work on a copy
-    std::vector<std::tuple<BasicBlock *, Value *>> Targets;
-
-    // Get the result of the analysis
-    auto const &RIV = getAnalysis<ReachableIntegerValuesPass>()
-                          .getReachableIntegerValuesMap();
-
-    for (BasicBlock &BB : F) {
-      // do not handle exception stuff
-      if (BB.isLandingPad())
-        continue;
-
-      if (Dist(RNG) <= Ratio) {
-        // Do we have any integer value reachable from this BB?
-        auto const &ReachableValues = RIV.lookup(&BB);
-        size_t ReachableValuesCount = ReachableValues.size();
-        if (ReachableValuesCount) {
-          // Yes! pick a random one
-          std::uniform_int_distribution<size_t> Dist(0, ReachableValuesCount-1);
-          auto Iter = ReachableValues.begin();
-          std::advance(Iter, Dist(RNG));
-          DEBUG(errs() << "picking: " << **Iter
-                       << " as random context value\n");
-          // Store the binding and a BB to duplicate and the context variable
-          // used to hide it
-          Targets.emplace_back(&BB, *Iter);
-
-          ++DuplicateBBCount;
-        } else {
-          DEBUG(errs() << "no context value found\n");
-        }
-      }
+/*****************************************
+ * Pass implementation
+ *****************************************/
+
+void DuplicateBBPass::initialize(Module &M, StringRef PassName) {
+  this->M = &M;
+  this->PassName = PassName.str();
+  ModuleBudget =
+      GrowthBudget(getInstructionCount(M), DuplicateBBMaxModuleGrowth);
+  Ratios = FunctionRatios(M, DEBUG_TYPE, DuplicateBBPolicy,
+                          DuplicateBBRatio.getValue().getRatio());
+
+  // Similar to MBA's
+  Cache = FunctionCache();
+  if (not DuplicateBBCacheDir.empty() and not ModuleBudget.isLimited()) {
+    std::string Options;
+    raw_string_ostream(Options)
+        << format("%a", DuplicateBBRatio.getValue().getRatio()) << ' '
+        << format("%a", DuplicateBBHotThreshold.getValue()) << ' '
+        << format("%a", DuplicateBBHotRatio.getValue().getRatio()) << ' '
+        << DuplicateBBLivePHIs << ' ' << DuplicateBBMaxGrowth << ' '
+        << DuplicateBBLoopMode << ' ' << DuplicateBBMaxWindow << ' '
+        << DuplicateBBBranchWeights << ' ' << DuplicateBBContext;
+    Cache = FunctionCache(DuplicateBBCacheDir, PassName, Options);
+  }
+}
+
+PreservedAnalyses DuplicateBBPass::run(Function &F,
+                                       AnalysisManager<Function> *AM) {
+  // There is no module initialization in the new pass manager, and the
+  // random number generators are named after the legacy pass, so that both
+  // produce the same code
+  if (F.getParent() != M)
+    initialize(*F.getParent(), PassRegistry::getPassRegistry()
+                                   ->getPassInfo(&DuplicateBB::ID)
+                                   ->getPassName());
+
+  // There is no block frequency analysis in the new pass manager, compute
+  // it here when needed
+  BranchProbabilityInfo BPI;
+  BlockFrequencyInfo BFI;
+  if (needsBlockFrequencies()) {
+    LoopInfo &LI = AM->getResult<LoopAnalysis>(F);
+    BPI.calculate(F, LI);
+    BFI.calculate(F, BPI, LI);
+  }
+
+  LoopInfo *LI = DuplicateBBLoopMode != LM_None
+                     ? &AM->getResult<LoopAnalysis>(F)
+                     : nullptr;
+
+  if (not runOnFunction(F, AM->getResult<ReachableIntegerValuesAnalysis>(F),
+                        AM->getResult<DominatorTreeAnalysis>(F),
+                        needsBlockFrequencies() ? &BFI : nullptr, LI))
+    return PreservedAnalyses::all();
+
+  // Same as the legacy pass: the analyses used are kept up to date, unless
+  // function bodies may be read from the cache
+  if (Cache.isEnabled())
+    return PreservedAnalyses::none();
+  PreservedAnalyses PA;
+  PA.preserve<ReachableIntegerValuesAnalysis>();
+  PA.preserve<DominatorTreeAnalysis>();
+  if (LI)
+    PA.preserve<LoopAnalysis>();
+  return PA;
+}
+
+bool DuplicateBBPass::runOnFunction(Function &F, ReachableIntegerValues &RIV,
+                                    DominatorTree &DT,
+                                    BlockFrequencyInfo const *BFI,
+                                    LoopInfo *LI) {
+  Report.start();
+  RNG = compat::createRNG(PassName, F);
+  uint64_t InstructionCount = getInstructionCount(F);
+  double const Ratio = Ratios.get(F);
+
+  std::string CacheKey;
+  if (Cache.isEnabled()) {
+    std::string FunctionOptions;
+    raw_string_ostream(FunctionOptions) << format("%a", Ratio);
+    CacheKey = Cache.getKey(F, FunctionOptions);
+  }
+  if (not CacheKey.empty()) {
+    if (Cache.lookup(F, CacheKey)) {
+      ++DuplicateBBCacheHitCount;
+      // what has been duplicated is not known
+      Report.emit(DEBUG_TYPE, F,
+                  {{"cached", 1},
+                   {"instructions-before", InstructionCount},
+                   {"instructions-after", getInstructionCount(F)},
+                   {"duplicated-blocks", FunctionReport::Unknown},
+                   {"phis", FunctionReport::Unknown}});
+      return true;
     }
+    ++DuplicateBBCacheMissCount;
+  }
+
+  std::uniform_real_distribution<double> Dist(0., 1.);
 
-    // Run the actual duplication
+  // We're going to modify the CFG, so work on a copy
+  std::vector<BasicBlock *> Targets;
 
-    // Because we will modify values, we need to
-    // keep track of the new bindings, otherwise, the information from the
-    // ReachableIntegerValuesPass will be obsolete
+  for (BasicBlock &BB : F) {
+    // do not handle exception stuff
+    if (BB.isLandingPad())
+      continue;
 
-    std::map<Value *, Value *> ReMapper;
-    for (auto &BB_Ctx : Targets) {
-      duplicate(*std::get<0>(BB_Ctx), std::get<1>(BB_Ctx), ReMapper);
+    // innermost loops have no sub loops
+    if (DuplicateBBLoopMode == LM_SkipInnermost)
+      if (Loop *L = LI->getLoopFor(&BB))
+        if (L->empty())
+          continue;
+
+    // Hot basic blocks may use a lower ratio
+    if (Dist(RNG) < getBlockRatio(BB, BFI, Ratio, DuplicateBBHotThreshold,
+                                   DuplicateBBHotRatio.getValue().getRatio()))
+      Targets.push_back(&BB);
+  }
+
+  // With a limited budget, spend it on cold and small blocks first
+  GrowthBudget FunctionBudget(InstructionCount, DuplicateBBMaxGrowth);
+  if (FunctionBudget.isLimited() or ModuleBudget.isLimited())
+    std::stable_sort(
+        Targets.begin(), Targets.end(),
+        [BFI](BasicBlock const *LHS, BasicBlock const *RHS) {
+          uint64_t LHSFreq = BFI->getBlockFreq(LHS).getFrequency(),
+                   RHSFreq = BFI->getBlockFreq(RHS).getFrequency();
+          if (LHSFreq != RHSFreq)
+            return LHSFreq < RHSFreq;
+          return LHS->size() < RHS->size();
+        });
+
+  // The result of the analysis is kept up to date by each duplication, so
+  // the context values are picked right before duplicating, and always
+  // refer to valid values.
+  // Run the actual duplication
+  bool Modified = false;
+  unsigned DuplicatedCount = 0;
+  FunctionPHICount = 0;
+  for (BasicBlock *BB : Targets) {
+    Instruction *WindowBegin = BB->getFirstNonPHI(),
+                *WindowEnd = BB->getTerminator();
+    if (DuplicateBBMaxWindow)
+      selectWindow(*BB, WindowBegin, WindowEnd);
+
+    uint64_t Growth = getDuplicationGrowth(*WindowBegin, *WindowEnd);
+    if (not FunctionBudget.canAfford(Growth) or
+        not ModuleBudget.canAfford(Growth)) {
+      ++DuplicateBBOverBudgetCount;
+      continue;
     }
 
-    return not Targets.empty();
-  }
-
-private:
-  void duplicate(BasicBlock &BB, Value *ContextValue,
-                 std::map<Value *, Value *> &ReMapper) {
-    // do not duplicate phi nodes and the likes, so start right after them
-    Instruction *BBHead = BB.getFirstNonPHI();
-
-    IRBuilder<> Builder(BBHead);
-
-    Value *Cond = Builder.CreateIsNull(
-        ReMapper.count(ContextValue) ?
-        ReMapper[ContextValue] :
-        ContextValue);
-
-    // the goals is to get from
-    // BB --> TERM
-    // to
-    //        BB Clone
-    // COND <          > TAIL --> TERM
-    //        BB Clone
-    //
-    // where TAIL contains PHI nodes that merges the two branches
-
-    TerminatorInst *ThenTerm = nullptr, *ElseTerm = nullptr;
-    // useful function from /BasicBlockUtils.h to create the new CFG
-    SplitBlockAndInsertIfThenElse(Cond, &*BBHead, &ThenTerm, &ElseTerm);
-
-    BasicBlock *Tail = ThenTerm->getSuccessor(0);
-
-    // This does more than a simple Value to Value map!
-    ValueToValueMapTy TailVMap;
-    ValueToValueMapTy ThenVMap;
-    ValueToValueMapTy ElseVMap;
-
-    // It's always hazardous to remove instruction on the fly, so store them here and purge later
-    SmallVector<Instruction*, 8> ToRemove;
-
-    // iterate through the original basic block, clone every instruction to
-    // add them to the true/false branch
-    // and update their use on the fly, through values stored in then_mapping
-    // and else_mapping
-    for (auto IIT = Tail->begin(), IE = Tail->end();
-         IIT != IE; ++IIT)
-    {
-      Instruction &Instr = *IIT;
-      assert(not isa<PHINode>(&Instr) and
-             "phi nodes have already been filtered out");
-
-      // We have a different processing of the last instruction
-      if (not isa<TerminatorInst>(&Instr)) {
-        // once the instruction is cloned, its operand still hold reference to
-        // the original basic block
-        // we want them to refer to the cloned one! The mappings are used for
-        // this
-        Instruction *ThenClone = Instr.clone(),
-                    *ElseClone = Instr.clone();
-
-        RemapInstruction(ThenClone, ThenVMap, RF_IgnoreMissingEntries);
-        ThenClone->insertBefore(ThenTerm);
-        ThenVMap[&Instr] = ThenClone;
-
-        RemapInstruction(ElseClone, ElseVMap, RF_IgnoreMissingEntries);
-        ElseClone->insertBefore(ElseTerm);
-        ElseVMap[&Instr] = ElseClone;
-
-        // instructions that don't produce a value don't need to be in the Tail
-        if(ThenClone->getType()->isVoidTy()) {
-          ToRemove.push_back(&Instr);
-        }
-        else {
-        // instruction that produce a value should not require a slot in the
-        // TAIL *but* they can be used from the context, so just always
-        // generate a PHI, and let further optimization do the cleaning
-          PHINode *Phi = PHINode::Create(ThenClone->getType(), 3);
-          Phi->addIncoming(ThenClone, ThenTerm->getParent());
-          Phi->addIncoming(ElseClone, ElseTerm->getParent());
-          TailVMap[&Instr] = Phi;
-
-          ReMapper[&Instr] = Phi;
-
-          // As we modify the instructions as we go,
-          // use the iterator version of ReplaceInstWithInst
-          ReplaceInstWithInst(Tail->getInstList(),
-                              IIT, Phi);
-        }
-      } else {
-        RemapInstruction(&Instr, TailVMap, RF_IgnoreMissingEntries);
+    // The context value is picked before the window is split from the rest
+    // of its block, so that the block is only split when duplicated. The
+    // condition goes right before the window, after the phi nodes and the
+    // likes.
+    Instruction *CondPt = WindowBegin;
+    Value *ContextValue = nullptr;
+
+    // The values reachable from a loop header are defined outside of the
+    // loop, so they are loop invariants and the condition can be computed
+    // in the preheader. This leaves a loop invariant branch in the loop,
+    // that loop unswitching can then turn into two versions of the loop.
+    if (DuplicateBBLoopMode == LM_Hoist)
+      if (Loop *L = LI->getLoopFor(BB))
+        if (BasicBlock *Preheader = L->getLoopPreheader())
+          if ((ContextValue = pickContextValue(
+                   *WindowBegin, *L->getHeader()->getFirstNonPHI(), RIV,
+                   DT))) {
+            CondPt = Preheader->getTerminator();
+            ++DuplicateBBHoistedCount;
+          }
+
+    // Do we have any integer value reachable from the window?
+    // If yes, pick a random one
+    if (not ContextValue)
+      ContextValue = pickContextValue(*WindowBegin, *WindowBegin, RIV, DT);
+
+    if (not ContextValue) {
+      DEBUG(errs() << "no context value found\n");
+      continue;
+    }
+    DEBUG(errs() << "picking: " << *ContextValue
+                 << " as random context value\n");
+
+    // The window becomes a block of its own, from which the values defined
+    // before it are reachable
+    if (WindowBegin != BB->getFirstNonPHI() or
+        WindowEnd != BB->getTerminator()) {
+      BB = splitWindow(*BB, *WindowBegin, *WindowEnd, RIV, DT, LI);
+      ++DuplicateBBWindowCount;
+    }
+
+    // Duplicate the BB, using the context variable to hide it
+    IRBuilder<> Builder(CondPt);
+    Value *Cond = Builder.CreateIsNull(ContextValue);
+    duplicate(*BB, Cond, RIV, DT, LI);
+    Modified = true;
+
+    FunctionBudget.consume(Growth);
+    ModuleBudget.consume(Growth);
+    DuplicateBBGrowth += Growth;
+    ++DuplicateBBCount;
+    ++DuplicatedCount;
+  }
+
+  if (not CacheKey.empty())
+    Cache.store(F, CacheKey);
+
+  Report.emit(DEBUG_TYPE, F,
+              {{"cached", 0},
+               {"instructions-before", InstructionCount},
+               {"instructions-after", getInstructionCount(F)},
+               {"duplicated-blocks", DuplicatedCount},
+               {"phis", FunctionPHICount}});
+  return Modified;
+}
+
+Value *DuplicateBBPass::pickContextValue(Instruction &Begin, Instruction &From,
+                                         ReachableIntegerValues const &RIV,
+                                         DominatorTree const &DT) {
+  // Once split from the rest of its block, From reaches the values its block
+  // defines before it, which are the nearest ones
+  BasicBlock *FromBB = From.getParent();
+  SmallVector<Value *, 8> Defined;
+  SmallPtrSet<Instruction const *, 16> Before;
+  for (BasicBlock::iterator IIT(&From), IB(FromBB->getFirstNonPHI());
+       IIT != IB;) {
+    Instruction &Instr = *--IIT;
+    Before.insert(&Instr);
+    if (Instr.getType()->isIntegerTy())
+      Defined.push_back(&Instr);
+  }
+  auto GetValue = [&](size_t Index) {
+    return Index < Defined.size()
+               ? Defined[Index]
+               : RIV.getReachableIntegerValue(FromBB, Index - Defined.size());
+  };
+
+  size_t Count = Defined.size() + RIV.getReachableIntegerValuesCount(FromBB);
+  if (not Count)
+    return nullptr;
+
+  Value *ContextValue;
+  if (DuplicateBBContext == CM_Nearest) {
+    // Values come nearest first, only look for live ones among the first
+    // ones, as those defined far away are unlikely to be used there
+    constexpr size_t MaxScanned = 64, MaxCandidates = 8;
+    SmallVector<Value *, MaxCandidates> Candidates;
+    for (size_t Index = 0, End = std::min(Count, MaxScanned);
+         Index != End and Candidates.size() < MaxCandidates; ++Index) {
+      Value *V = GetValue(Index);
+      if (isLiveIn(V, From, Before, DT))
+        Candidates.push_back(V);
+    }
+    for (size_t Index = 0, End = std::min(Count, MaxCandidates);
+         Candidates.empty() and Index != End; ++Index)
+      Candidates.push_back(GetValue(Index));
+    std::uniform_int_distribution<size_t> Dist(0, Candidates.size() - 1);
+    ContextValue = Candidates[Dist(RNG)];
+  } else {
+    std::uniform_int_distribution<size_t> Dist(0, Count - 1);
+    ContextValue = GetValue(Dist(RNG));
+  }
+
+  // The live range of a value that is not live in From is extended up to
+  // From. The remark is about the duplicated block, even when the value is
+  // picked from the loop header.
+  Function &F = *FromBB->getParent();
+  if (not areRemarksEnabled(DEBUG_TYPE, F))
+    return ContextValue;
+  std::string Message;
+  raw_string_ostream(Message)
+      << "function=" << F.getName() << " block=" << Begin.getParent()->getName()
+      << " context=" << ContextValue->getName()
+      << " live-in=" << isLiveIn(ContextValue, From, Before, DT)
+      << " dominator-distance="
+      << getDominatorDistance(ContextValue, FromBB, DT);
+  emitOptimizationRemarkAnalysis(F.getContext(), DEBUG_TYPE, F,
+                                 Begin.getDebugLoc(), Message);
+  return ContextValue;
+}
+
+void DuplicateBBPass::selectWindow(BasicBlock &BB, Instruction *&Begin,
+                                   Instruction *&End) {
+  size_t const MaxWindow = DuplicateBBMaxWindow;
+  size_t Count = std::distance(BasicBlock::iterator(Begin),
+                               BasicBlock::iterator(End));
+  if (Count <= MaxWindow)
+    return;
+
+  std::uniform_int_distribution<size_t> Dist(0, Count - MaxWindow);
+  BasicBlock::iterator IIT(Begin);
+  std::advance(IIT, Dist(RNG));
+  Begin = &*IIT;
+  std::advance(IIT, MaxWindow);
+  End = &*IIT;
+}
+
+BasicBlock *DuplicateBBPass::splitWindow(BasicBlock &BB, Instruction &Begin,
+                                         Instruction &End,
+                                         ReachableIntegerValues &RIV,
+                                         DominatorTree &DT, LoopInfo *LI) {
+  // SplitBlock keeps the dominator tree and the loops up to date
+  BasicBlock *Window = &BB;
+  if (&Begin != BB.getFirstNonPHI()) {
+    Window = SplitBlock(&BB, &Begin, &DT, LI);
+    RIV.splitBlock(&BB, Window);
+  }
+  if (&End != Window->getTerminator()) {
+    BasicBlock *Rest = SplitBlock(Window, &End, &DT, LI);
+    RIV.splitBlock(Window, Rest);
+  }
+  return Window;
+}
+
+void DuplicateBBPass::duplicate(BasicBlock &BB, Value *Cond,
+                                ReachableIntegerValues &RIV,
+                                DominatorTree &DT, LoopInfo *LI) {
+  // do not duplicate phi nodes and the likes, so start right after them
+  // the condition may have been inserted there
+  Instruction *BBHead = BB.getFirstNonPHI();
+  if (BBHead == Cond)
+    BBHead = BBHead->getNextNode();
+
+  // the goals is to get from
+  // BB --> TERM
+  // to
+  //        BB Clone
+  // COND <          > TAIL --> TERM
+  //        BB Clone
+  //
+  // where TAIL contains PHI nodes that merges the two branches
+
+  TerminatorInst *ThenTerm = nullptr, *ElseTerm = nullptr;
+  // useful function from /BasicBlockUtils.h to create the new CFG
+  SplitBlockAndInsertIfThenElse(Cond, &*BBHead, &ThenTerm, &ElseTerm);
+
+  BasicBlock *Tail = ThenTerm->getSuccessor(0);
+  BasicBlock *ThenBB = ThenTerm->getParent(),
+             *ElseBB = ElseTerm->getParent();
+
+  // Update the dominator tree: TAIL now dominates what BB used to dominate,
+  // and BB dominates the new blocks
+  SmallVector<DomTreeNode *, 4> Children(DT.getNode(&BB)->begin(),
+                                         DT.getNode(&BB)->end());
+  DomTreeNode *TailNode = DT.addNewBlock(Tail, &BB);
+  for (DomTreeNode *Child : Children)
+    DT.changeImmediateDominator(Child, TailNode);
+  DT.addNewBlock(ThenBB, &BB);
+  DT.addNewBlock(ElseBB, &BB);
+
+  // And the reachable integer values accordingly
+  RIV.splitBlock(&BB, Tail);
+  RIV.addBlock(ThenBB, &BB);
+  RIV.addBlock(ElseBB, &BB);
+
+  // And the loops, if any
+  if (LI)
+    if (Loop *L = LI->getLoopFor(&BB))
+      for (BasicBlock *NewBB : {Tail, ThenBB, ElseBB})
+        L->addBasicBlockToLoop(NewBB, *LI);
+
+  // Both clones compute the same thing, but one may be known to be taken:
+  // tell the optimizers, and make it the fall-through of BB
+  std::pair<uint32_t, uint32_t> Weights;
+  if (DuplicateBBBranchWeights)
+    if (auto *Cmp = dyn_cast<ICmpInst>(Cond))
+      if (getIsNullWeights(Cmp->getOperand(0), Cmp, DT, Weights)) {
+        BB.getTerminator()->setMetadata(
+            LLVMContext::MD_prof,
+            MDBuilder(BB.getContext())
+                .createBranchWeights(Weights.first, Weights.second));
+
+        BasicBlock *Likely = ThenBB, *Unlikely = ElseBB;
+        if (Weights.first < Weights.second)
+          std::swap(Likely, Unlikely);
+        Likely->moveAfter(&BB);
+        Unlikely->moveAfter(&BB.getParent()->back());
       }
+
+  // The structures are only reallocated for a block larger than all the
+  // previous ones, as clearing them keeps their storage
+  size_t const Size = Tail->size();
+  for (size_t Capacity :
+       {Clones.capacity(), Positions.capacity(), ToRemove.capacity()})
+    if (Capacity < Size)
+      ++DuplicateBBAllocationCount;
+  Clones.reserve(Size);
+  Positions.reserve(Size);
+  ToRemove.reserve(Size);
+
+  // The instructions left in the tail until the end are found by address
+  for (Instruction &Instr : *Tail)
+    Positions.push_back(std::make_pair(&Instr, Positions.size()));
+  std::sort(Positions.begin(), Positions.end());
+
+  // iterate through the original basic block, clone every instruction to
+  // add them to the true/false branch
+  // and update their use on the fly, through the clones recorded so far
+  for (auto IIT = Tail->begin(), IE = Tail->end();
+       IIT != IE; ++IIT)
+  {
+    Instruction &Instr = *IIT;
+    assert(not isa<PHINode>(&Instr) and
+           "phi nodes have already been filtered out");
+
+    // We have a different processing of the last instruction
+    if (not isa<TerminatorInst>(&Instr)) {
+      // once the instruction is cloned, its operand still hold reference to
+      // the original basic block
+      // we want them to refer to the cloned one! The mappings are used for
+      // this
+      Instruction *ThenClone = Instr.clone(),
+                  *ElseClone = Instr.clone();
+
+      remapClones(*ThenClone, *ElseClone, *Tail);
+      ThenClone->insertBefore(ThenTerm);
+      ElseClone->insertBefore(ElseTerm);
+      Clones.push_back({ThenClone, ElseClone});
+
+      // instructions that don't produce a value don't need to be in the Tail
+      if(ThenClone->getType()->isVoidTy()) {
+        ToRemove.push_back(&Instr);
+      }
+      // neither do values only used by the duplicated instructions, if we
+      // care about liveness
+      else if(DuplicateBBLivePHIs and not isLiveOut(Instr)) {
+        RIV.removeValue(&Instr);
+        ToRemove.push_back(&Instr);
+        ++DuplicateBBAvoidedPHICount;
+      }
+      else {
+      // instruction that produce a value should not require a slot in the
+      // TAIL *but* they can be used from the context, so just always
+      // generate a PHI, and let further optimization do the cleaning
+        PHINode *Phi = PHINode::Create(ThenClone->getType(), 3);
+        Phi->addIncoming(ThenClone, ThenBB);
+        Phi->addIncoming(ElseClone, ElseBB);
+
+        RIV.replaceValue(&Instr, Phi);
+        ++DuplicateBBPHICount;
+        ++FunctionPHICount;
+
+        // As we modify the instructions as we go,
+        // use the iterator version of ReplaceInstWithInst
+        ReplaceInstWithInst(Tail->getInstList(),
+                            IIT, Phi);
+      }
+    }
+  }
+
+  // purging the instructions that don't produce a value from the Tail
+  // in reverse order, so that the remaining users are erased first
+  for(auto* I : make_range(ToRemove.rbegin(), ToRemove.rend()))
+    I->eraseFromParent();
+
+  Clones.clear();
+  Positions.clear();
+  ToRemove.clear();
+}
+
+bool DuplicateBBPass::getClones(Value const *V, BasicBlock const &Tail,
+                                ClonePair &Pair) const {
+  auto const *Instr = dyn_cast<Instruction>(V);
+  if (not Instr or Instr->getParent() != &Tail)
+    return false;
+
+  // the only phi nodes of the tail are those that merge the clones, the
+  // following instructions use them once the instructions are replaced
+  if (auto const *Phi = dyn_cast<PHINode>(Instr)) {
+    Pair = {cast<Instruction>(Phi->getIncomingValue(0)),
+            cast<Instruction>(Phi->getIncomingValue(1))};
+    return true;
+  }
+
+  auto Where = std::lower_bound(Positions.begin(), Positions.end(),
+                                std::make_pair(Instr, 0u));
+  if (Where == Positions.end() or Where->first != Instr or
+      Where->second >= Clones.size())
+    return false;
+  Pair = Clones[Where->second];
+  return true;
+}
+
+void DuplicateBBPass::remapClones(Instruction &ThenClone,
+                                  Instruction &ElseClone,
+                                  BasicBlock const &Tail) const {
+  for (unsigned I = 0, E = ThenClone.getNumOperands(); I != E; ++I) {
+    Value *Op = ThenClone.getOperand(I);
+    ClonePair Pair;
+
+    // debug intrinsics refer to the values through metadata
+    if (auto *MAV = dyn_cast<MetadataAsValue>(Op)) {
+      if (auto *Local = dyn_cast<LocalAsMetadata>(MAV->getMetadata()))
+        if (getClones(Local->getValue(), Tail, Pair)) {
+          LLVMContext &Ctx = Op->getContext();
+          ThenClone.setOperand(
+              I, MetadataAsValue::get(Ctx, LocalAsMetadata::get(Pair.Then)));
+          ElseClone.setOperand(
+              I, MetadataAsValue::get(Ctx, LocalAsMetadata::get(Pair.Else)));
+        }
+      continue;
     }
 
-    // purging the instructions that don't produce a value from the Tail
-    for(auto* I : ToRemove)
-      I->eraseFromParent();
+    if (getClones(Op, Tail, Pair)) {
+      ThenClone.setOperand(I, Pair.Then);
+      ElseClone.setOperand(I, Pair.Else);
+    }
   }
-};
 }
 
 /* for opt pass registration
@@ -225,8 +879,18 @@ static RegisterPass<DuplicateBB> X("duplicate-bb",
 
 static void registerClangPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM) {
-  PM.add(new DuplicateBB());
+  if (!DuplicateBBLate)
+    PM.add(new DuplicateBB());
+}
+static void registerLateClangPass(const PassManagerBuilder &,
+                                  legacy::PassManagerBase &PM) {
+  if (DuplicateBBLate)
+    PM.add(new DuplicateBB());
 }
+// As MBA's, the late insertion point is not reached at -O0
 static RegisterStandardPasses
     RegisterClangPass(PassManagerBuilder::EP_EarlyAsPossible,
                       registerClangPass);
+static RegisterStandardPasses
+    RegisterLateClangPass(PassManagerBuilder::EP_OptimizerLast,
+                          registerLateClangPass);
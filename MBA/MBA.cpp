@@ -20,15 +20,31 @@
  */
 #include "llvm/ADT/Statistic.h"
 STATISTIC(MBACount, "The # of substituted instructions");
+STATISTIC(MBAGrowth, "The # of instructions added");
+STATISTIC(MBAOverBudgetCount,
+          "The # of substitutions skipped because of the growth budget");
+STATISTIC(MBASharedCount,
+          "The # of sub-expressions shared between substitutions");
+STATISTIC(MBACacheHitCount, "The # of functions read from the cache");
+STATISTIC(MBACacheMissCount, "The # of functions missing from the cache");
+STATISTIC(MBAEstimatedCost,
+          "The estimated cost added by the substitutions, as per the target");
 
 #include "llvm/Pass.h"
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/Analysis/BranchProbabilityInfo.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/ADT/DenseMap.h"
 #include "llvm/IR/IRBuilder.h"
 #include "llvm/IR/Module.h"
 #include "llvm/IR/Function.h"
+#include "llvm/Support/Format.h"
 #include "llvm/Support/raw_ostream.h"
 #include "llvm/IR/InstrTypes.h"
 #include "llvm/Transforms/Utils/BasicBlockUtils.h"
 
+#include "MBA.h"
 #include "Utils.h"
 
 /*****************************************
@@ -43,14 +59,357 @@ static llvm::cl::opt<Ratio> MBARatio{
     llvm::cl::desc("Only apply the mba pass on <ratio> of the candidates"),
     llvm::cl::value_desc("ratio"), llvm::cl::init(1.), llvm::cl::Optional};
 
+// Profile guidance: keep hot basic blocks fast
+static llvm::cl::opt<double> MBAHotThreshold{
+    "mba-hot-threshold",
+    llvm::cl::desc("Basic blocks executed more than <threshold> times per "
+                   "function call are hot, 0 disables profile guidance"),
+    llvm::cl::value_desc("threshold"), llvm::cl::init(0.), llvm::cl::Optional};
+static llvm::cl::opt<Ratio> MBAHotRatio{
+    "mba-hot-ratio",
+    llvm::cl::desc("Only apply the mba pass on <ratio> of the candidates "
+                   "from hot basic blocks"),
+    llvm::cl::value_desc("ratio"), llvm::cl::init(0.), llvm::cl::Optional};
+
+// Obfuscation strength, as the minimal number of instructions a substitution
+// should be made of. The cheapest substitution that meets it is used.
+static llvm::cl::opt<unsigned> MBAComplexity{
+    "mba-complexity",
+    llvm::cl::desc("Only use substitutions made of at least <n> instructions, "
+                   "when available"),
+    llvm::cl::value_desc("n"), llvm::cl::init(4), llvm::cl::Optional};
+
+// Code growth control, in percent of the initial instruction count
+static llvm::cl::opt<unsigned> MBAMaxGrowth{
+    "mba-max-growth",
+    llvm::cl::desc("Do not grow functions by more than <percent> "
+                   "instructions, 0 means no limit"),
+    llvm::cl::value_desc("percent"), llvm::cl::init(0), llvm::cl::Optional};
+static llvm::cl::opt<unsigned> MBAMaxModuleGrowth{
+    "mba-max-module-growth",
+    llvm::cl::desc("Do not grow the module by more than <percent> "
+                   "instructions, 0 means no limit"),
+    llvm::cl::value_desc("percent"), llvm::cl::init(0), llvm::cl::Optional};
+
+// Position in the clang pipeline: running after the vectorizers keeps the
+// scalar substitutions from hiding vectorizable code
+static llvm::cl::opt<bool> MBALate{
+    "mba-late",
+    llvm::cl::desc("Run the mba pass at the end of the clang pipeline, after "
+                   "vectorization"),
+    llvm::cl::init(false), llvm::cl::Optional};
+
+// Sub-expression sharing: the substitutions of a basic block reuse the
+// operations already computed by the block or by previous substitutions
+// instead of emitting them again
+static llvm::cl::opt<bool> MBADAG{
+    "mba-dag",
+    llvm::cl::desc("Share identical sub-expressions between the substitutions "
+                   "of a basic block"),
+    llvm::cl::init(false), llvm::cl::Optional};
+
+// Selective obfuscation: the ratio may be set per function, by annotations
+// or by a policy file
+static llvm::cl::opt<ObfuscationPolicy> MBAPolicy{
+    "mba-policy",
+    llvm::cl::desc("Read the ratio of the mba pass on each function from "
+                   "<file>"),
+    llvm::cl::value_desc("file"), llvm::cl::Optional};
+
+// Incremental builds: obfuscated functions are cached on disk
+static llvm::cl::opt<std::string> MBACacheDir{
+    "mba-cache-dir",
+    llvm::cl::desc("Cache the obfuscated functions in <directory>"),
+    llvm::cl::value_desc("directory"), llvm::cl::init(""), llvm::cl::Optional};
+
 using namespace llvm;
 
+/*****************************************
+ * MBA rules
+ *****************************************/
+
+// Each rule is an expression template over the operands X and Y of the binary
+// operator it substitutes. The size, the cost and the code of a rule are all
+// derived from its expression at compile time, and each rule is checked
+// against the operator it substitutes on a few sample values, also at compile
+// time. As MBA identities hold modulo 2^n, checking them on 64 bits
+// values is enough for any integer type. They hold lane-wise too, so integer
+// vectors are handled the same way, constants being splatted.
+// The cost depends on the target and on the type of the operands, so it is
+// estimated through TargetTransformInfo.
+namespace rules {
+
+// The operations available at some point of a basic block, indexed by
+// opcode and operands, commutative operands being ordered
+class ExpressionCache {
+  typedef std::pair<unsigned, std::pair<Value *, Value *>> KeyTy;
+  DenseMap<KeyTy, Value *> Expressions;
+
+  static KeyTy getKey(unsigned Opcode, Value *LHS, Value *RHS) {
+    if (Instruction::isCommutative(Opcode) and RHS < LHS)
+      std::swap(LHS, RHS);
+    return std::make_pair(Opcode, std::make_pair(LHS, RHS));
+  }
+
+public:
+  Value *lookup(unsigned Opcode, Value *LHS, Value *RHS) const {
+    return Expressions.lookup(getKey(Opcode, LHS, RHS));
+  }
+  void insert(unsigned Opcode, Value *LHS, Value *RHS, Value *V) {
+    Expressions[getKey(Opcode, LHS, RHS)] = V;
+  }
+  // Operators with poison-generating flags are left out, as the rules
+  // emit operations without flags
+  void insert(BinaryOperator *BinOp) {
+    if (isa<OverflowingBinaryOperator>(BinOp) and
+        (BinOp->hasNoSignedWrap() or BinOp->hasNoUnsignedWrap()))
+      return;
+    if (isa<PossiblyExactOperator>(BinOp) and BinOp->isExact())
+      return;
+    insert(BinOp->getOpcode(), BinOp->getOperand(0), BinOp->getOperand(1),
+           BinOp);
+  }
+  void clear() { Expressions.clear(); }
+};
+
+// Generates the code of the rules, reusing the operations from Cache if
+// any, and keeps track of the number and of the estimated cost of the
+// instructions actually emitted
+class Emitter {
+  IRBuilder<> &Builder;
+  TargetTransformInfo const &TTI;
+  ExpressionCache *Cache;
+  unsigned Count = 0, Cost = 0;
+
+public:
+  Emitter(IRBuilder<> &Builder, TargetTransformInfo const &TTI,
+          ExpressionCache *Cache)
+      : Builder(Builder), TTI(TTI), Cache(Cache) {}
+
+  Value *create(unsigned Opcode, Value *LHS, Value *RHS) {
+    if (Cache)
+      if (Value *Shared = Cache->lookup(Opcode, LHS, RHS)) {
+        ++MBASharedCount;
+        return Shared;
+      }
+    Value *V = Builder.CreateBinOp(static_cast<Instruction::BinaryOps>(Opcode),
+                                   LHS, RHS);
+    if (Cache)
+      Cache->insert(Opcode, LHS, RHS, V);
+    ++Count;
+    Cost += TTI.getArithmeticInstrCost(
+        Opcode, V->getType(),
+        isa<Constant>(LHS) ? TargetTransformInfo::OK_UniformConstantValue
+                           : TargetTransformInfo::OK_AnyValue,
+        isa<Constant>(RHS) ? TargetTransformInfo::OK_UniformConstantValue
+                           : TargetTransformInfo::OK_AnyValue);
+    return V;
+  }
+
+  unsigned getCount() const { return Count; }
+  unsigned getCost() const { return Cost; }
+};
+
+constexpr uint64_t apply(unsigned Opcode, uint64_t A, uint64_t B) {
+  return Opcode == Instruction::Add ? A + B :
+         Opcode == Instruction::Sub ? A - B :
+         Opcode == Instruction::Mul ? A * B :
+         Opcode == Instruction::And ? A & B :
+         Opcode == Instruction::Or  ? A | B :
+         Opcode == Instruction::Xor ? A ^ B :
+         Opcode == Instruction::Shl ? A << B :
+         0;
+}
+
+struct X {
+  static constexpr unsigned Size = 0;
+  static constexpr bool IsConstant = false;
+  static constexpr bool HasShl = false;
+  static unsigned getCost(TargetTransformInfo const &, Type *) { return 0; }
+  static constexpr uint64_t eval(uint64_t A, uint64_t) { return A; }
+  static Value *emit(Emitter &, Value *A, Value *) { return A; }
+};
+
+struct Y {
+  static constexpr unsigned Size = 0;
+  static constexpr bool IsConstant = false;
+  static constexpr bool HasShl = false;
+  static unsigned getCost(TargetTransformInfo const &, Type *) { return 0; }
+  static constexpr uint64_t eval(uint64_t, uint64_t B) { return B; }
+  static Value *emit(Emitter &, Value *, Value *B) { return B; }
+};
+
+template <class T>
+constexpr TargetTransformInfo::OperandValueKind getOperandKind() {
+  return T::IsConstant ? TargetTransformInfo::OK_UniformConstantValue
+                       : TargetTransformInfo::OK_AnyValue;
+}
+
+template <uint64_t N> struct Const {
+  static constexpr unsigned Size = 0;
+  static constexpr bool IsConstant = true;
+  static constexpr bool HasShl = false;
+  static unsigned getCost(TargetTransformInfo const &, Type *) { return 0; }
+  static constexpr uint64_t eval(uint64_t, uint64_t) { return N; }
+  static Value *emit(Emitter &, Value *A, Value *) {
+    return ConstantInt::get(A->getType(), N);
+  }
+};
+
+struct AllOnes {
+  static constexpr unsigned Size = 0;
+  static constexpr bool IsConstant = true;
+  static constexpr bool HasShl = false;
+  static unsigned getCost(TargetTransformInfo const &, Type *) { return 0; }
+  static constexpr uint64_t eval(uint64_t, uint64_t) { return ~0ULL; }
+  static Value *emit(Emitter &, Value *A, Value *) {
+    return Constant::getAllOnesValue(A->getType());
+  }
+};
+
+template <unsigned Opcode, class L, class R> struct BinOp {
+  static constexpr unsigned Size = 1 + L::Size + R::Size;
+  static constexpr bool IsConstant = false;
+  static constexpr bool HasShl =
+      Opcode == Instruction::Shl or L::HasShl or R::HasShl;
+  static unsigned getCost(TargetTransformInfo const &TTI, Type *Ty) {
+    return TTI.getArithmeticInstrCost(Opcode, Ty, getOperandKind<L>(),
+                                      getOperandKind<R>()) +
+           L::getCost(TTI, Ty) + R::getCost(TTI, Ty);
+  }
+  static constexpr uint64_t eval(uint64_t A, uint64_t B) {
+    return apply(Opcode, L::eval(A, B), R::eval(A, B));
+  }
+  static Value *emit(Emitter &E, Value *A, Value *B) {
+    return E.create(Opcode, L::emit(E, A, B), R::emit(E, A, B));
+  }
+};
+
+template <class L, class R> using Add = BinOp<Instruction::Add, L, R>;
+template <class L, class R> using Sub = BinOp<Instruction::Sub, L, R>;
+template <class L, class R> using Mul = BinOp<Instruction::Mul, L, R>;
+template <class L, class R> using And = BinOp<Instruction::And, L, R>;
+template <class L, class R> using Or = BinOp<Instruction::Or, L, R>;
+template <class L, class R> using Xor = BinOp<Instruction::Xor, L, R>;
+template <class L, class R> using Shl = BinOp<Instruction::Shl, L, R>;
+template <class T> using Not = Xor<T, AllOnes>;
+
+template <unsigned Opcode, class Expr>
+constexpr bool checkRuleOn(uint64_t A, uint64_t B) {
+  return Expr::eval(A, B) == apply(Opcode, A, B);
+}
+
+template <unsigned Opcode, class Expr> constexpr bool checkRule() {
+  return checkRuleOn<Opcode, Expr>(0, 0) and
+         checkRuleOn<Opcode, Expr>(1, 2) and
+         checkRuleOn<Opcode, Expr>(42, 42) and
+         checkRuleOn<Opcode, Expr>(~0ULL, 3) and
+         checkRuleOn<Opcode, Expr>(0xdeadbeefULL, 0x12345678ULL) and
+         checkRuleOn<Opcode, Expr>(0x8000000000000000ULL,
+                                   0x7fffffffffffffffULL);
+}
+
+// What the pass needs to know about a rule
+struct RuleInfo {
+  unsigned Opcode;
+  unsigned Size;
+  bool HasShl;
+  unsigned (*getCost)(TargetTransformInfo const &, Type *);
+  Value *(*Emit)(Emitter &, Value *, Value *);
+};
+
+template <unsigned Opcode, class Expr> struct Rule {
+  static_assert(checkRule<Opcode, Expr>(), "invalid MBA rule");
+  static constexpr RuleInfo info() {
+    return {Opcode, Expr::Size, Expr::HasShl, &Expr::getCost, &Expr::emit};
+  }
+};
+
+// The rules themselves, adding a rule is just a matter of adding a line here
+// Multiplications by 2 are also provided as shifts, the target decides which
+// one is cheaper
+constexpr RuleInfo Rules[] = {
+  // a + b == (a ^ b) + 2 * (a & b)
+  Rule<Instruction::Add, Add<Xor<X, Y>, Mul<Const<2>, And<X, Y>>>>::info(),
+  Rule<Instruction::Add, Add<Xor<X, Y>, Shl<And<X, Y>, Const<1>>>>::info(),
+  // a + b == (a | b) + (a & b)
+  Rule<Instruction::Add, Add<Or<X, Y>, And<X, Y>>>::info(),
+  // a + b == 2 * (a | b) - (a ^ b)
+  Rule<Instruction::Add, Sub<Mul<Const<2>, Or<X, Y>>, Xor<X, Y>>>::info(),
+  Rule<Instruction::Add, Sub<Shl<Or<X, Y>, Const<1>>, Xor<X, Y>>>::info(),
+  // a - b == (a ^ b) - 2 * (~a & b)
+  Rule<Instruction::Sub,
+       Sub<Xor<X, Y>, Mul<Const<2>, And<Not<X>, Y>>>>::info(),
+  Rule<Instruction::Sub,
+       Sub<Xor<X, Y>, Shl<And<Not<X>, Y>, Const<1>>>>::info(),
+  // a - b == (a & ~b) - (~a & b)
+  Rule<Instruction::Sub, Sub<And<X, Not<Y>>, And<Not<X>, Y>>>::info(),
+  // a - b == a + ~b + 1
+  Rule<Instruction::Sub, Add<Add<X, Not<Y>>, Const<1>>>::info(),
+  // a ^ b == (a | b) - (a & b)
+  Rule<Instruction::Xor, Sub<Or<X, Y>, And<X, Y>>>::info(),
+  // a ^ b == (a + b) - 2 * (a & b)
+  Rule<Instruction::Xor, Sub<Add<X, Y>, Mul<Const<2>, And<X, Y>>>>::info(),
+  Rule<Instruction::Xor, Sub<Add<X, Y>, Shl<And<X, Y>, Const<1>>>>::info(),
+  // a | b == (a ^ b) + (a & b)
+  Rule<Instruction::Or, Add<Xor<X, Y>, And<X, Y>>>::info(),
+  // a | b == (a & ~b) + b
+  Rule<Instruction::Or, Add<And<X, Not<Y>>, Y>>::info(),
+  // a & b == (a + b) - (a | b)
+  Rule<Instruction::And, Sub<Add<X, Y>, Or<X, Y>>>::info(),
+  // a & b == (~a | b) - ~a
+  Rule<Instruction::And, Sub<Or<Not<X>, Y>, Not<X>>>::info(),
+  // a * b == (a & b) * (a | b) + (a & ~b) * (~a & b)
+  Rule<Instruction::Mul, Add<Mul<And<X, Y>, Or<X, Y>>,
+                             Mul<And<X, Not<Y>>, And<Not<X>, Y>>>>::info(),
+};
+
+// The cheapest rule for Opcode on Ty made of at least Complexity
+// instructions, or the most complex one if none is. Ties are broken by the
+// order of the table. Rules that shift are left out on i1, where shifting by
+// 1 is poison.
+RuleInfo const *selectRule(unsigned Opcode, Type *Ty, unsigned Complexity,
+                           TargetTransformInfo const &TTI) {
+  RuleInfo const *Best = nullptr;
+  unsigned BestCost = 0;
+  for (RuleInfo const &Candidate : Rules) {
+    if (Candidate.Opcode != Opcode)
+      continue;
+    if (Candidate.HasShl and Ty->getScalarSizeInBits() == 1)
+      continue;
+    unsigned CandidateCost = Candidate.getCost(TTI, Ty);
+    if (not Best) {
+      Best = &Candidate;
+      BestCost = CandidateCost;
+      continue;
+    }
+    bool BestIsComplexEnough = Best->Size >= Complexity,
+         CandidateIsComplexEnough = Candidate.Size >= Complexity;
+    bool IsBetter;
+    if (BestIsComplexEnough != CandidateIsComplexEnough)
+      IsBetter = CandidateIsComplexEnough;
+    else if (BestIsComplexEnough)
+      IsBetter = CandidateCost < BestCost;
+    else
+      IsBetter = Candidate.Size > Best->Size or
+                 (Candidate.Size == Best->Size and CandidateCost < BestCost);
+    if (IsBetter) {
+      Best = &Candidate;
+      BestCost = CandidateCost;
+    }
+  }
+  return Best;
+}
+}
+
 // anonymous namespace -> avoid exporting unneeded symbols
 namespace {
 
 // A pass that perform a simple instruction substitution
 // see http://llvm.org/docs/WritingAnLLVMPass.html#the-basicblockpass-class
 class MBA : public BasicBlockPass {
+  MBAPass Impl;
+  TargetTransformInfo const *TTI = nullptr;
 
 public:
   // The address of this static is used to uniquely identify this pass in the
@@ -58,88 +417,276 @@ public:
   // analyses passes and build dependencies on demand.
   // The value does not matter.
   static char ID;
-  compat::RandomNumberGenerator RNG;
 
-  MBA() : BasicBlockPass(ID)
-          , RNG(nullptr)
-  {}
+  MBA() : BasicBlockPass(ID) {}
 
   // Called once for each module, before the calls on the basic blocks.
-  // We could use doFinalization to clear RNG, but that's not needed.
   bool doInitialization(Module &M) override {
-    RNG = M.createRNG(this);
+    Impl.initialize(M, getPassName());
+    return false;
+  }
+
+  // Called once for each function, before the calls on its basic blocks.
+  // The cost model is built for each function, so it is only queried here.
+  bool doInitialization(Function &F) override {
+    TTI = &getAnalysis<TargetTransformInfoWrapperPass>().getTTI(F);
+    return Impl.initialize(F);
+  }
+
+  // Called once for each function, after the calls on its basic blocks.
+  bool doFinalization(Function &F) override {
+    Impl.finalize(F);
     return false;
   }
 
+  // The target cost model drives the rule selection.
+  // Block frequencies are only needed for profile guidance
+  void getAnalysisUsage(AnalysisUsage &Info) const override {
+    Info.addRequired<TargetTransformInfoWrapperPass>();
+    if (MBAHotThreshold > 0.)
+      Info.addRequired<BlockFrequencyInfoWrapperPass>();
+  }
+
   // Called for each basic block of the module
-  // Rely on the equality: a + b == (a ^ b) + 2 * (a & b)
   bool runOnBasicBlock(BasicBlock &BB) override {
-    bool modified = false;
-    std::uniform_real_distribution<double> Dist(0., 1.);
-
-    // Can't use a for-range loop because we want to delete the instruction from
-    // the list we're iterating when replacing it.
-    for (auto IIT = BB.begin(), IE = BB.end(); IIT != IE; ++IIT) {
-      Instruction &Inst = *IIT;
-      // not regular C++ a dynamic_cast!
-      // see http://llvm.org/docs/ProgrammersManual.html#the-isa-cast-and-dyn-cast-templates
-      auto *BinOp = dyn_cast<BinaryOperator>(&Inst);
-      if (!BinOp)
-        // The instruction is not a binary operator, we don't handle it.
-        continue;
-
-      if (Dist(RNG) > MBARatio.getRatio())
-        // Probabilistic replacement, skip if we are not in the threshold.
-        continue;
-
-      unsigned Opcode = BinOp->getOpcode();
-      if (Opcode != Instruction::Add || !BinOp->getType()->isIntegerTy())
-        // Only handle integer add.
-        // Note instead of doing a dyn_cast to a BinaryOperator above, we could
-        // have done directly a dyn_cast to AddOperator, but this way seems more
-        // effective to later add other operator.
-        continue;
-
-      // The IRBuilder helps you inserting instructions in a clean and
-      // fast way
-      // see
-      // http://llvm.org/docs/ProgrammersManual.html#creating-and-inserting-new-instructions
-      IRBuilder<> Builder(BinOp);
-
-      Value *NewValue = Builder.CreateAdd(
-        Builder.CreateXor(BinOp->getOperand(0),
-                          BinOp->getOperand(1)),
-        Builder.CreateMul(
-          ConstantInt::get(BinOp->getType(), 2),
-          Builder.CreateAnd(
-            BinOp->getOperand(0),
-            BinOp->getOperand(1)))
-      );
+    return Impl.runOnBasicBlock(
+        BB, *TTI,
+        MBAHotThreshold > 0.
+            ? &getAnalysis<BlockFrequencyInfoWrapperPass>().getBFI()
+            : nullptr);
+  }
+};
+}
+
+/*****************************************
+ * Pass implementation
+ *****************************************/
+
+void MBAPass::initialize(Module &M, StringRef PassName) {
+  this->M = &M;
+  this->PassName = PassName.str();
+  ModuleBudget = GrowthBudget(getInstructionCount(M), MBAMaxModuleGrowth);
+  Ratios = FunctionRatios(M, DEBUG_TYPE, MBAPolicy, MBARatio.getRatio());
+
+  // The module budget depends on the other functions, so functions are only
+  // cached without it. The target is part of the function key.
+  Cache = FunctionCache();
+  if (not MBACacheDir.empty() and not ModuleBudget.isLimited()) {
+    std::string Options;
+    raw_string_ostream(Options)
+        << format("%a", MBARatio.getRatio()) << ' '
+        << format("%a", MBAHotThreshold.getValue()) << ' '
+        << format("%a", MBAHotRatio.getRatio()) << ' ' << MBAComplexity << ' '
+        << MBADAG << ' ' << MBAMaxGrowth;
+    Cache = FunctionCache(MBACacheDir, PassName, Options);
+  }
+}
+
+bool MBAPass::initialize(Function &F) {
+  Report.start();
+  RNG = compat::createRNG(PassName, F);
+  FunctionInstructionCount = getInstructionCount(F);
+  FunctionBudget = GrowthBudget(FunctionInstructionCount, MBAMaxGrowth);
+  SelectedRules.clear();
+  TTI = nullptr;
+  FunctionCost = 0;
+  FunctionSubstitutionCount = 0;
+  FunctionRatio = Ratios.get(F);
+
+  CacheKey = "";
+  if (Cache.isEnabled()) {
+    std::string FunctionOptions;
+    raw_string_ostream(FunctionOptions) << format("%a", FunctionRatio);
+    CacheKey = Cache.getKey(F, FunctionOptions);
+  }
+  FromCache = not CacheKey.empty() and Cache.lookup(F, CacheKey);
+  if (FromCache)
+    ++MBACacheHitCount;
+  else if (not CacheKey.empty())
+    ++MBACacheMissCount;
+  return FromCache;
+}
+
+void MBAPass::finalize(Function &F) {
+  if (not CacheKey.empty() and not FromCache)
+    Cache.store(F, CacheKey);
+  DEBUG(if (FunctionCost) dbgs() << F.getName() << ": estimated cost +"
+                                 << FunctionCost << "\n");
+
+  // What has been substituted in a cached body is not known
+  Report.emit(DEBUG_TYPE, F,
+              {{"cached", FromCache},
+               {"instructions-before", FunctionInstructionCount},
+               {"instructions-after", getInstructionCount(F)},
+               {"substitutions", FromCache ? FunctionReport::Unknown
+                                           : FunctionSubstitutionCount},
+               {"cost", FromCache ? FunctionReport::Unknown : FunctionCost}});
+}
+
+PreservedAnalyses MBAPass::run(Function &F, AnalysisManager<Function> *AM) {
+  // There is no module initialization in the new pass manager, and the
+  // random number generators are named after the legacy pass, so that both
+  // produce the same code
+  if (F.getParent() != M)
+    initialize(*F.getParent(), PassRegistry::getPassRegistry()
+                                   ->getPassInfo(&MBA::ID)
+                                   ->getPassName());
+
+  // There is no block frequency analysis in the new pass manager, compute
+  // it here when needed
+  BranchProbabilityInfo BPI;
+  BlockFrequencyInfo BFI;
+  if (MBAHotThreshold > 0.) {
+    LoopInfo &LI = AM->getResult<LoopAnalysis>(F);
+    BPI.calculate(F, LI);
+    BFI.calculate(F, BPI, LI);
+  }
 
-      // The following is visible only if you pass -debug on the command line
-      // *and* you have an assert build.
-      DEBUG(dbgs() << *BinOp << " -> " << *NewValue << "\n");
-
-      // ReplaceInstWithValue basically does this (`IIT' is passed by reference):
-      // IIT->replaceAllUsesWith(NewValue);
-      // IIT = BB.getInstList.erase(IIT);
-      //
-      // `erase' returns a valid iterator of the instruction before the
-      // one that has been erased. This keeps iterators valid.
-      //
-      // see also
-      // http://llvm.org/docs/ProgrammersManual.html#replacing-an-instruction-with-another-value
-      ReplaceInstWithValue(BB.getInstList(),
-                           IIT, NewValue);
-      modified = true;
-
-      // update statistics!
-      // They are printed out with -stats on the opt command line
-      ++MBACount;
+  TargetTransformInfo &TTI = AM->getResult<TargetIRAnalysis>(F);
+
+  bool Modified = initialize(F);
+  for (BasicBlock &BB : F)
+    Modified |=
+        runOnBasicBlock(BB, TTI, MBAHotThreshold > 0. ? &BFI : nullptr);
+  finalize(F);
+
+  if (not Modified)
+    return PreservedAnalyses::all();
+
+  // A cached body comes with its own CFG
+  if (FromCache)
+    return PreservedAnalyses::none();
+
+  // Only instructions are substituted, the CFG is left untouched
+  PreservedAnalyses PA;
+  PA.preserve<DominatorTreeAnalysis>();
+  PA.preserve<LoopAnalysis>();
+  return PA;
+}
+
+// The rule to use for Opcode on Ty, if any
+rules::RuleInfo const *MBAPass::getRule(unsigned Opcode, Type *Ty) {
+  auto Where = SelectedRules.find(std::make_pair(Opcode, Ty));
+  if (Where != SelectedRules.end())
+    return Where->second;
+  rules::RuleInfo const *Rule =
+      rules::selectRule(Opcode, Ty, MBAComplexity, *TTI);
+  SelectedRules[std::make_pair(Opcode, Ty)] = Rule;
+  return Rule;
+}
+
+// Rely on the equalities from the rules above
+bool MBAPass::runOnBasicBlock(BasicBlock &BB, TargetTransformInfo const &TTI,
+                              BlockFrequencyInfo const *BFI) {
+  if (FromCache)
+    return false;
+
+  bool modified = false;
+  std::uniform_real_distribution<double> Dist(0., 1.);
+
+  // for the rule selection
+  this->TTI = &TTI;
+
+  // Hot basic blocks may use a lower ratio
+  double const Ratio = getBlockRatio(BB, BFI, FunctionRatio, MBAHotThreshold,
+                                     MBAHotRatio.getRatio());
+
+  // Collect the candidates first, so that the instructions we insert are
+  // not considered for substitution
+  SmallVector<BinaryOperator *, 8> Candidates;
+  for (Instruction &Inst : BB) {
+    // not regular C++ a dynamic_cast!
+    // see http://llvm.org/docs/ProgrammersManual.html#the-isa-cast-and-dyn-cast-templates
+    auto *BinOp = dyn_cast<BinaryOperator>(&Inst);
+    if (!BinOp)
+      // The instruction is not a binary operator, we don't handle it.
+      continue;
+
+    if (Dist(RNG) >= Ratio)
+      // Probabilistic replacement, skip if we are not in the threshold.
+      continue;
+
+    if (!BinOp->getType()->isIntOrIntVectorTy() ||
+        !getRule(BinOp->getOpcode(), BinOp->getType()))
+      // Only handle integer and integer vector operators we have a rule
+      // for.
+      continue;
+
+    Candidates.push_back(BinOp);
+  }
+
+  // In DAG mode, the operations computed before the current candidate,
+  // walked incrementally
+  rules::ExpressionCache Cache;
+  BasicBlock::iterator Available = BB.begin();
+
+  for (BinaryOperator *BinOp : Candidates) {
+    Type *Ty = BinOp->getType();
+    rules::RuleInfo const &Rule = *getRule(BinOp->getOpcode(), Ty);
+
+    if (MBADAG)
+      for (; &*Available != BinOp; ++Available)
+        if (auto *Prev = dyn_cast<BinaryOperator>(&*Available))
+          Cache.insert(Prev);
+
+    // The substituted instruction is removed. Sharing can only make the
+    // actual growth lower.
+    unsigned MaxGrowth = Rule.Size - 1;
+    if (not FunctionBudget.canAfford(MaxGrowth) or
+        not ModuleBudget.canAfford(MaxGrowth)) {
+      ++MBAOverBudgetCount;
+      continue;
     }
-    return modified;
+
+    // The IRBuilder helps you inserting instructions in a clean and
+    // fast way
+    // see
+    // http://llvm.org/docs/ProgrammersManual.html#creating-and-inserting-new-instructions
+    IRBuilder<> Builder(BinOp);
+    rules::Emitter Emitter(Builder, TTI, MBADAG ? &Cache : nullptr);
+
+    Value *NewValue =
+        Rule.Emit(Emitter, BinOp->getOperand(0), BinOp->getOperand(1));
+
+    if (unsigned Growth = Emitter.getCount() ? Emitter.getCount() - 1 : 0) {
+      FunctionBudget.consume(Growth);
+      ModuleBudget.consume(Growth);
+      MBAGrowth += Growth;
+    }
+
+    // Cost added with respect to the original operation
+    unsigned Cost = Emitter.getCost();
+    unsigned OriginalCost = TTI.getArithmeticInstrCost(BinOp->getOpcode(), Ty);
+    unsigned AddedCost = Cost > OriginalCost ? Cost - OriginalCost : 0;
+    FunctionCost += AddedCost;
+    MBAEstimatedCost += AddedCost;
+
+    // The following is visible only if you pass -debug on the command line
+    // *and* you have an assert build.
+    DEBUG(dbgs() << *BinOp << " -> " << *NewValue << " (cost " << Cost
+                 << ")\n");
+
+    // ReplaceInstWithValue basically does this (`IIT' is passed by reference):
+    // IIT->replaceAllUsesWith(NewValue);
+    // IIT = BB.getInstList.erase(IIT);
+    //
+    // see also
+    // http://llvm.org/docs/ProgrammersManual.html#replacing-an-instruction-with-another-value
+    BasicBlock::iterator IIT(BinOp);
+    if (MBADAG)
+      Cache.insert(BinOp->getOpcode(), BinOp->getOperand(0),
+                   BinOp->getOperand(1), NewValue);
+    ReplaceInstWithValue(BB.getInstList(),
+                         IIT, NewValue);
+    Available = IIT;
+    modified = true;
+
+    // update statistics!
+    // They are printed out with -stats on the opt command line
+    ++MBACount;
+    ++FunctionSubstitutionCount;
   }
-};
+  return modified;
 }
 
 // pass registration is done through the constructor of static objects...
@@ -161,9 +708,16 @@ static RegisterPass<MBA>
 
 static void registerClangPass(const PassManagerBuilder &,
                               legacy::PassManagerBase &PM)
-{ PM.add(new MBA()); }
+{ if (!MBALate) PM.add(new MBA()); }
+
+static void registerLateClangPass(const PassManagerBuilder &,
+                                  legacy::PassManagerBase &PM)
+{ if (MBALate) PM.add(new MBA()); }
 
 // Note the registration point, clang offers several insertion points where you
 // can insert your pass.
+// The late insertion point is not reached at -O0.
 static RegisterStandardPasses RegisterClangPass
     (PassManagerBuilder::EP_EarlyAsPossible, registerClangPass);
+static RegisterStandardPasses RegisterLateClangPass
+    (PassManagerBuilder::EP_OptimizerLast, registerLateClangPass);
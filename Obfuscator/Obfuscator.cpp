@@ -0,0 +1,601 @@
+/**
+ * Obfuscation driver
+ *
+ * This runs the obfuscation passes given on the command line, like opt does,
+ * but can split the module into partitions that are obfuscated in parallel,
+ * each in its own LLVMContext, and linked back together.
+ *
+ * The partitioning only depends on the number of partitions, and each
+ * function draws its own random numbers, so the output does not depend on
+ * the number of threads.
+ *
+ * Several files can be obfuscated in a single run, which saves the process
+ * startup and the option parsing. They are processed on a pool of workers,
+ * each file in its own LLVMContext, and written in place or to an output
+ * directory.
+ *
+ * In LTO mode, the inputs are linked and optimized as the linker would, and
+ * the functions are obfuscated once inlined, each in its final form. The
+ * partitions then play the role of the parallel LTO backends.
+ *
+ * This showcases the development of a tool that embeds passes.
+ */
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/Triple.h"
+#include "llvm/Analysis/LoopInfo.h"
+#include "llvm/Analysis/TargetLibraryInfo.h"
+#include "llvm/Analysis/TargetTransformInfo.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/CodeGen/CommandFlags.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/LLVMContext.h"
+#include "llvm/IR/LegacyPassManager.h"
+#include "llvm/IR/LegacyPassNameParser.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/PassManager.h"
+#include "llvm/IR/Verifier.h"
+#include "llvm/IRReader/IRReader.h"
+#include "llvm/InitializePasses.h"
+#include "llvm/Linker/Linker.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/ErrorHandling.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/ManagedStatic.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/PrettyStackTrace.h"
+#include "llvm/Support/Signals.h"
+#include "llvm/Support/SourceMgr.h"
+#include "llvm/Support/TargetRegistry.h"
+#include "llvm/Support/TargetSelect.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/ToolOutputFile.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Target/TargetMachine.h"
+#include "llvm/Transforms/IPO.h"
+#include "llvm/Transforms/IPO/PassManagerBuilder.h"
+#include "llvm/Transforms/Utils/SplitModule.h"
+
+#include "DuplicateBB.h"
+#include "MBA.h"
+#include "ReachableIntegerValues.h"
+#include "Utils.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+using namespace llvm;
+
+static cl::list<const PassInfo *, bool, PassNameParser>
+    PassList(cl::desc("Obfuscations available:"));
+
+static cl::list<std::string> InputFilenames(cl::Positional,
+                                            cl::desc("<input files>"),
+                                            cl::ZeroOrMore);
+
+static cl::opt<std::string> OutputFilename("o",
+                                           cl::desc("Override output filename"),
+                                           cl::value_desc("filename"),
+                                           cl::init("-"));
+
+// Several inputs are written either in place, or to a directory
+static cl::opt<bool> InPlace("i",
+                             cl::desc("Overwrite the inputs with their output"));
+static cl::opt<std::string>
+    OutputDirectory("output-dir",
+                    cl::desc("Write the outputs to <dir>, under the name of "
+                             "their input"),
+                    cl::value_desc("dir"));
+
+// In place, or in a directory, each output keeps the format of its input
+static cl::opt<bool> OutputAssembly("S",
+                                    cl::desc("Write output as LLVM assembly"));
+
+// The output only depends on the number of partitions
+static cl::opt<unsigned> Partitions{
+    "partitions",
+    cl::desc("Split the module into <n> partitions obfuscated in parallel"),
+    cl::value_desc("n"), cl::init(1), cl::Optional};
+static cl::opt<unsigned> Threads{
+    "j",
+    cl::desc("Obfuscate the files, or the partitions of a single file, on <n> "
+             "threads, 0 means one per core"),
+    cl::value_desc("n"), cl::init(0), cl::Optional};
+
+// There is no extension point in the LTO pipeline, so it is run here
+static cl::opt<bool> LTO{
+    "lto",
+    cl::desc("Link the inputs, and run the link time optimizations before "
+             "obfuscating the result"),
+    cl::init(false), cl::Optional};
+static cl::opt<unsigned> LTOOptLevel{
+    "lto-O", cl::desc("Optimization level of the link time optimizations"),
+    cl::value_desc("0-3"), cl::init(2), cl::Optional};
+
+// The target machine of M, created as opt does, so that the passes see the
+// same costs in both tools. Null when M has no target, or an unknown one.
+static std::unique_ptr<TargetMachine> createTargetMachine(Module const &M) {
+  Triple TheTriple(M.getTargetTriple());
+  if (not TheTriple.getArch())
+    return nullptr;
+  std::string Error;
+  Target const *TheTarget =
+      TargetRegistry::lookupTarget(MArch, TheTriple, Error);
+  if (not TheTarget)
+    return nullptr;
+  return std::unique_ptr<TargetMachine>(TheTarget->createTargetMachine(
+      TheTriple.getTriple(), getCPUStr(), getFeaturesStr(),
+      InitTargetOptionsFromCodeGenFlags(), RelocModel, CMModel));
+}
+
+// The cost model of the target of M
+static ImmutablePass *createTTIPass(TargetMachine *TM) {
+  return createTargetTransformInfoWrapperPass(TM ? TM->getTargetIRAnalysis()
+                                                 : TargetIRAnalysis());
+}
+
+// Both pass managers produce the same output
+static cl::opt<bool> NewPassManager{
+    "new-pm", cl::desc("Run the passes through the new pass manager"),
+    cl::init(false), cl::Optional};
+
+// Whether the pass of PI has a version for the new pass manager
+static bool hasNewPassManagerVersion(PassInfo const &PI) {
+  StringRef Name = PI.getPassArgument();
+  return Name == "mba" or Name == "duplicate-bb" or
+         Name == "reachable-integer-values";
+}
+
+// Run the passes from the command line on M, through the new pass manager
+static void obfuscateWithNewPassManager(Module &M, TargetMachine *TM) {
+  FunctionAnalysisManager FAM;
+  FAM.registerPass(DominatorTreeAnalysis());
+  FAM.registerPass(LoopAnalysis());
+  FAM.registerPass(ReachableIntegerValuesAnalysis());
+  FAM.registerPass(TM ? TM->getTargetIRAnalysis() : TargetIRAnalysis());
+  ModuleAnalysisManager MAM;
+  MAM.registerPass(FunctionAnalysisManagerModuleProxy(FAM));
+  FAM.registerPass(ModuleAnalysisManagerFunctionProxy(MAM));
+
+  // the analysis is computed on demand by the passes that need it
+  FunctionPassManager FPM;
+  for (PassInfo const *PI : PassList) {
+    StringRef Name = PI->getPassArgument();
+    if (Name == "mba")
+      FPM.addPass(MBAPass());
+    else if (Name == "duplicate-bb")
+      FPM.addPass(DuplicateBBPass());
+  }
+  ModulePassManager MPM;
+  MPM.addPass(createModuleToFunctionPassAdaptor(std::move(FPM)));
+  MPM.addPass(VerifierPass());
+  MPM.run(M, &MAM);
+}
+
+// Run the passes from the command line on M
+static void obfuscate(Module &M) {
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(M);
+  if (NewPassManager)
+    return obfuscateWithNewPassManager(M, TM.get());
+
+  legacy::PassManager PM;
+  PM.add(createTTIPass(TM.get()));
+  for (PassInfo const *PI : PassList)
+    PM.add(PI->getNormalCtor()());
+  PM.add(createVerifierPass());
+  PM.run(M);
+}
+
+static void writeBitcode(Module const &M, SmallVectorImpl<char> &Buffer) {
+  raw_svector_ostream OS(Buffer);
+  WriteBitcodeToFile(&M, OS);
+}
+
+static std::unique_ptr<Module> readBitcode(SmallVectorImpl<char> const &Buffer,
+                                           StringRef ModuleID,
+                                           LLVMContext &Context) {
+  ErrorOr<std::unique_ptr<Module>> M = parseBitcodeFile(
+      MemoryBufferRef(StringRef(Buffer.data(), Buffer.size()), ModuleID),
+      Context);
+  if (std::error_code EC = M.getError())
+    report_fatal_error("cannot read partition: " + EC.message());
+  return std::move(*M);
+}
+
+// The annotations of functions, by function name
+typedef std::vector<std::pair<std::string, std::string>> AnnotationList;
+
+static AnnotationList getAnnotations(Module const &M) {
+  SmallVector<std::pair<Function const *, StringRef>, 8> Annotations;
+  getFunctionAnnotations(M, Annotations);
+  AnnotationList Result;
+  for (auto const &Annotation : Annotations)
+    Result.emplace_back(Annotation.first->getName(), Annotation.second);
+  return Result;
+}
+
+// SplitModule moves the annotations to a single partition, so the other ones
+// get a copy of the annotations of their functions, for the passes to read.
+// Return the globals added to M, so that they can be removed once the passes
+// have run.
+static std::vector<GlobalVariable *>
+addAnnotations(Module &M, AnnotationList const &Annotations) {
+  std::vector<GlobalVariable *> Added;
+  if (M.getNamedGlobal("llvm.global.annotations"))
+    return Added;
+
+  LLVMContext &Context = M.getContext();
+  Type *Int8PtrTy = Type::getInt8PtrTy(Context);
+  Type *Int32Ty = Type::getInt32Ty(Context);
+  StructType *EntryTy =
+      StructType::get(Context, {Int8PtrTy, Int8PtrTy, Int8PtrTy, Int32Ty});
+  std::vector<Constant *> Entries;
+  for (auto const &Annotation : Annotations) {
+    Function *F = M.getFunction(Annotation.first);
+    if (not F or F->isDeclaration())
+      continue;
+    Constant *String = ConstantDataArray::getString(Context, Annotation.second);
+    auto *StringGV =
+        new GlobalVariable(M, String->getType(), true,
+                           GlobalValue::PrivateLinkage, String, ".str");
+    Added.push_back(StringGV);
+    Entries.push_back(ConstantStruct::get(
+        EntryTy, {ConstantExpr::getBitCast(F, Int8PtrTy),
+                  ConstantExpr::getBitCast(StringGV, Int8PtrTy),
+                  ConstantPointerNull::get(cast<PointerType>(Int8PtrTy)),
+                  ConstantInt::get(Int32Ty, 0)}));
+  }
+  if (Entries.empty())
+    return Added;
+
+  ArrayType *ArrayTy = ArrayType::get(EntryTy, Entries.size());
+  auto *Global = new GlobalVariable(
+      M, ArrayTy, false, GlobalValue::AppendingLinkage,
+      ConstantArray::get(ArrayTy, Entries), "llvm.global.annotations");
+  Global->setSection("llvm.metadata");
+  // erased first, as it refers to the strings
+  Added.insert(Added.begin(), Global);
+  return Added;
+}
+
+// Obfuscate M by partitions on ThreadCount threads, and return the linked
+// result
+static std::unique_ptr<Module> obfuscateInParallel(std::unique_ptr<Module> M,
+                                                   unsigned ThreadCount) {
+  LLVMContext &Context = M->getContext();
+  std::string ModuleID = M->getModuleIdentifier();
+
+  // Splitting exposes local symbols, remember them to hide them back
+  StringMap<std::pair<GlobalValue::LinkageTypes, GlobalValue::VisibilityTypes>>
+      LocalSymbols;
+  auto RecordLocal = [&LocalSymbols](GlobalValue &GV) {
+    if (GV.hasLocalLinkage() and GV.hasName())
+      LocalSymbols[GV.getName()] =
+          std::make_pair(GV.getLinkage(), GV.getVisibility());
+  };
+  for (Function &F : *M)
+    RecordLocal(F);
+  for (GlobalVariable &GV : M->globals())
+    RecordLocal(GV);
+  for (GlobalAlias &GA : M->aliases())
+    RecordLocal(GA);
+
+  AnnotationList Annotations = getAnnotations(*M);
+
+  // Partitions go through bitcode to move to their own context
+  std::vector<SmallString<0>> Parts;
+  SplitModule(std::move(M), Partitions, [&](std::unique_ptr<Module> Part) {
+    Parts.emplace_back();
+    writeBitcode(*Part, Parts.back());
+  });
+
+  {
+    ThreadPool Pool(ThreadCount);
+    for (SmallString<0> &Part : Parts)
+      Pool.async([&Part, &ModuleID, &Annotations] {
+        LLVMContext PartContext;
+        std::unique_ptr<Module> PartM =
+            readBitcode(Part, ModuleID, PartContext);
+        std::vector<GlobalVariable *> Added =
+            addAnnotations(*PartM, Annotations);
+        obfuscate(*PartM);
+        for (GlobalVariable *GV : Added)
+          GV->eraseFromParent();
+        Part.clear();
+        writeBitcode(*PartM, Part);
+      });
+    Pool.wait();
+  }
+
+  // Link back in partition order, for a deterministic output
+  auto Linked = llvm::make_unique<Module>(ModuleID, Context);
+  Linker L(*Linked);
+  for (SmallString<0> &Part : Parts)
+    if (L.linkInModule(readBitcode(Part, ModuleID, Context)))
+      report_fatal_error("cannot link partition");
+
+  for (auto &Symbol : LocalSymbols)
+    if (GlobalValue *GV = Linked->getNamedValue(Symbol.getKey())) {
+      GV->setVisibility(Symbol.getValue().second);
+      GV->setLinkage(Symbol.getValue().first);
+    }
+
+  return Linked;
+}
+
+// Where the output of Input goes
+static std::string getOutputFilename(StringRef Input) {
+  if (InPlace)
+    return Input.str();
+  if (OutputDirectory.empty())
+    return OutputFilename;
+  SmallString<128> Path(OutputDirectory);
+  sys::path::append(Path, sys::path::filename(Input));
+  return Path.str().str();
+}
+
+// Write M to Path, through a temporary file, so that an input overwritten in
+// place is never left half written
+static std::error_code writeModule(Module const &M, StringRef Path,
+                                   bool Assembly) {
+  SmallString<128> TmpPath(Path);
+  TmpPath += "-%%%%%%.tmp";
+  int FD;
+  if (std::error_code EC = sys::fs::createUniqueFile(TmpPath, FD, TmpPath))
+    return EC;
+  std::error_code EC;
+  {
+    raw_fd_ostream OS(FD, true);
+    if (Assembly)
+      OS << M;
+    else
+      WriteBitcodeToFile(&M, OS);
+    OS.close();
+    // the stream would report the error as fatal
+    if (OS.has_error()) {
+      OS.clear_error();
+      EC = std::make_error_code(std::errc::io_error);
+    }
+  }
+  if (not EC)
+    EC = sys::fs::rename(TmpPath, Path);
+  if (EC)
+    sys::fs::remove(TmpPath);
+  return EC;
+}
+
+// Run the link time optimizations on M, as libLTO does, without
+// internalizing its symbols
+static void optimizeForLTO(Module &M) {
+  std::unique_ptr<TargetMachine> TM = createTargetMachine(M);
+  legacy::PassManager PM;
+  PM.add(new TargetLibraryInfoWrapperPass(Triple(M.getTargetTriple())));
+  PM.add(createTTIPass(TM.get()));
+  unsigned const OptLevel = LTOOptLevel;
+  PassManagerBuilder PMB;
+  PMB.OptLevel = OptLevel;
+  PMB.Inliner = createFunctionInliningPass(OptLevel, 0);
+  PMB.LoopVectorize = PMB.SLPVectorize = OptLevel > 1;
+  PMB.populateLTOPassManager(PM);
+  PM.run(M);
+}
+
+// Diagnostics of concurrent workers must not interleave
+static std::mutex DiagnosticsMutex;
+
+// Read Input in Context, and tell whether it is bitcode. Return null on
+// error.
+static std::unique_ptr<Module> readModule(StringRef Input, LLVMContext &Context,
+                                          bool &IsBitcode) {
+  SMDiagnostic Err;
+  std::unique_ptr<Module> M;
+  {
+    // large files are memory mapped, and released once parsed, before the
+    // output may overwrite them
+    ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer =
+        MemoryBuffer::getFileOrSTDIN(Input);
+    if (std::error_code EC = Buffer.getError()) {
+      std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+      errs() << Input << ": " << EC.message() << '\n';
+      return nullptr;
+    }
+    IsBitcode = isBitcode(
+        reinterpret_cast<unsigned char const *>((*Buffer)->getBufferStart()),
+        reinterpret_cast<unsigned char const *>((*Buffer)->getBufferEnd()));
+    M = parseIR((*Buffer)->getMemBufferRef(), Err, Context);
+  }
+  if (!M) {
+    std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+    Err.print(Input.data(), errs());
+  }
+  return M;
+}
+
+// Write M to Output, through a temporary file in place or in a directory,
+// and as opt does otherwise, so that -o may name the standard output, a
+// device or a symbolic link. Return false on error.
+static bool writeOutput(Module const &M, StringRef Output, bool Assembly) {
+  std::error_code EC;
+  if (InPlace or not OutputDirectory.empty()) {
+    EC = writeModule(M, Output, Assembly);
+  } else {
+    tool_output_file Out(Output, EC, sys::fs::F_None);
+    if (not EC) {
+      if (Assembly)
+        Out.os() << M;
+      else
+        WriteBitcodeToFile(&M, Out.os());
+      // the standard output is not closed, only flushed
+      Out.os().flush();
+      if (Out.os().has_error()) {
+        Out.os().clear_error();
+        EC = std::make_error_code(std::errc::io_error);
+      } else {
+        Out.keep();
+      }
+    }
+  }
+  if (EC) {
+    std::lock_guard<std::mutex> Lock(DiagnosticsMutex);
+    errs() << Output << ": " << EC.message() << '\n';
+    return false;
+  }
+  return true;
+}
+
+// Obfuscate M, using ThreadCount threads for its partitions
+static std::unique_ptr<Module> obfuscate(std::unique_ptr<Module> M,
+                                         unsigned ThreadCount) {
+  if (Partitions > 1)
+    return obfuscateInParallel(std::move(M), ThreadCount);
+  obfuscate(*M);
+  return M;
+}
+
+// Obfuscate Input into Output, using ThreadCount threads for its partitions.
+// Return false on error.
+static bool processFile(StringRef Input, StringRef Output,
+                        unsigned ThreadCount) {
+  LLVMContext Context;
+  bool IsBitcode;
+  std::unique_ptr<Module> M = readModule(Input, Context, IsBitcode);
+  if (!M)
+    return false;
+
+  M = obfuscate(std::move(M), ThreadCount);
+
+  bool Assembly = OutputAssembly;
+  if (InPlace or not OutputDirectory.empty())
+    Assembly |= not IsBitcode;
+  return writeOutput(*M, Output, Assembly);
+}
+
+// Link the inputs, optimize and obfuscate the result into the output.
+// Return false on error.
+static bool processLTO(unsigned ThreadCount) {
+  LLVMContext Context;
+  // named as libLTO names the merged module
+  auto Linked = llvm::make_unique<Module>("ld-temp.o", Context);
+  Linker L(*Linked);
+  for (std::string const &Input : InputFilenames) {
+    bool IsBitcode;
+    std::unique_ptr<Module> M = readModule(Input, Context, IsBitcode);
+    if (!M)
+      return false;
+    if (L.linkInModule(std::move(M))) {
+      errs() << Input << ": cannot link\n";
+      return false;
+    }
+  }
+
+  optimizeForLTO(*Linked);
+  Linked = obfuscate(std::move(Linked), ThreadCount);
+  return writeOutput(*Linked, OutputFilename, OutputAssembly);
+}
+
+int main(int argc, char **argv) {
+  sys::PrintStackTraceOnErrorSignal();
+  PrettyStackTraceProgram X(argc, argv);
+  llvm_shutdown_obj Y;
+
+  // The cost models of the targets
+  InitializeAllTargets();
+  InitializeAllTargetMCs();
+
+  // The analyses required by the passes must be registered
+  PassRegistry &Registry = *PassRegistry::getPassRegistry();
+  initializeCore(Registry);
+  initializeAnalysis(Registry);
+  initializeTransformUtils(Registry);
+  initializeScalarOpts(Registry);
+  initializeVectorization(Registry);
+  initializeInstCombine(Registry);
+  initializeIPO(Registry);
+
+  cl::ParseCommandLineOptions(argc, argv, "obfuscation driver\n");
+
+  if (InputFilenames.empty())
+    InputFilenames.push_back("-");
+  bool Batch = InPlace or not OutputDirectory.empty();
+  if (InPlace and not OutputDirectory.empty()) {
+    errs() << argv[0] << ": -i and -output-dir are exclusive\n";
+    return 1;
+  }
+  if (Batch and OutputFilename != "-") {
+    errs() << argv[0] << ": -o cannot be used with -i or -output-dir\n";
+    return 1;
+  }
+  if (LTO and Batch) {
+    errs() << argv[0] << ": -lto cannot be used with -i or -output-dir\n";
+    return 1;
+  }
+  if (NewPassManager)
+    for (PassInfo const *PI : PassList)
+      if (not hasNewPassManagerVersion(*PI)) {
+        errs() << argv[0] << ": -" << PI->getPassArgument()
+               << " has no version for the new pass manager\n";
+        return 1;
+      }
+  if (LTO and LTOOptLevel > 3) {
+    errs() << argv[0] << ": -lto-O must be between 0 and 3\n";
+    return 1;
+  }
+  if (not LTO and not Batch and InputFilenames.size() > 1) {
+    errs() << argv[0] << ": several inputs require -i or -output-dir\n";
+    return 1;
+  }
+  if (Batch and std::find(InputFilenames.begin(), InputFilenames.end(), "-") !=
+                    InputFilenames.end()) {
+    errs() << argv[0] << ": the standard input cannot be written back\n";
+    return 1;
+  }
+  if (not OutputDirectory.empty()) {
+    StringSet<> Outputs;
+    for (std::string const &Input : InputFilenames)
+      if (not Outputs.insert(sys::path::filename(Input)).second) {
+        errs() << argv[0] << ": several inputs are named "
+               << sys::path::filename(Input) << '\n';
+        return 1;
+      }
+    if (std::error_code EC = sys::fs::create_directories(OutputDirectory)) {
+      errs() << OutputDirectory << ": " << EC.message() << '\n';
+      return 1;
+    }
+  }
+
+  // hardware_concurrency() is 0 when unknown
+  unsigned ThreadCount =
+      Threads ? Threads : std::max(1u, std::thread::hardware_concurrency());
+  if (LTO)
+    return processLTO(ThreadCount) ? 0 : 1;
+  if (InputFilenames.size() == 1)
+    return processFile(InputFilenames[0],
+                       getOutputFilename(InputFilenames[0]), ThreadCount)
+               ? 0
+               : 1;
+
+  // Each worker handles a whole file, so that the partitions of a file, if
+  // any, are not competing with the other files for the threads
+  std::atomic<bool> Failed(false);
+  {
+    ThreadPool Pool(ThreadCount);
+    for (std::string const &Input : InputFilenames)
+      Pool.async([&Input, &Failed] {
+        if (not processFile(Input, getOutputFilename(Input), 1))
+          Failed = true;
+      });
+    Pool.wait();
+  }
+  return Failed ? 1 : 0;
+}
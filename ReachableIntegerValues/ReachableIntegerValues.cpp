@@ -10,64 +10,241 @@
 #include "llvm/Support/Debug.h"
 
 #include "ReachableIntegerValues.h"
+#include "llvm/ADT/DepthFirstIterator.h"
 #include "llvm/IR/Dominators.h"
+#include "llvm/Support/CommandLine.h"
 
-#include <deque>
+#include <algorithm>
 
 using namespace llvm;
 
-ReachableIntegerValuesPass::ReachableIntegerValuesPass() : FunctionPass(ID) {}
+static cl::opt<bool> LazyReachableIntegerValues{
+    "reachable-integer-values-lazy",
+    cl::desc("Only compute the integer values reachable from a basic block "
+             "when it is queried"),
+    cl::init(false), cl::Optional};
 
-bool ReachableIntegerValuesPass::runOnFunction(Function &F) {
-  // The same instance of the analysis is created and registered, then used
-  // repetitively, so we must clear its state each time we enter runOnFunction
-  ReachableIntegerValuesMap.clear();
-
-  // First compute sets of integer values defined for each Basic block
-  ReachableIntegerValuesMapTy DefinedValuesMap;
-  for (BasicBlock &BB : F) {
-    auto &Values = DefinedValuesMap[&BB];
-    for (Instruction &Inst : BB)
-      if (Inst.getType()->isIntegerTy())
-        Values.insert(&Inst);
+constexpr unsigned ReachableIntegerValues::NoBlock;
+
+ReachableIntegerValues::ReachableIntegerValues(Function &F, DominatorTree &DT)
+    : F(&F), DT(&DT) {
+  // arguments and globals are always live, they are held by a pseudo block
+  // that dominates the entry block
+  Blocks.push_back({NoBlock, 0, 0});
+  for (Argument &Arg : F.args()) {
+    ValueNumbers[&Arg] = Values.size();
+    Values.push_back(&Arg);
+  }
+  Blocks.back().End = Values.size();
+
+  DEBUG(errs() << "In Function:\n" << F);
+
+  // in lazy mode, the walk is delayed until the blocks are queried
+  if (LazyReachableIntegerValues)
+    return;
+
+  // then use dominance tree to number the integer values: a depth-first walk
+  // guarantees that a block is numbered after its immediate dominator
+  for (auto *Node : depth_first(DT.getRootNode())) {
+    DEBUG(errs() << "processing BB " << Node->getBlock() << "\n");
+    auto *IDom = Node->getIDom();
+    numberBlock(Node, IDom ? BlockIndices.lookup(IDom->getBlock()) : 0);
   }
+}
 
-  // Second compute the reachable integer values
+bool ReachableIntegerValues::invalidate(Function &,
+                                        PreservedAnalyses const &PA) {
+  return not PA.preserved(ReachableIntegerValuesAnalysis::ID()) or
+         not PA.preserved(DominatorTreeAnalysis::ID());
+}
 
-  // arguments and globals are always live
-  auto &HeadValues = ReachableIntegerValuesMap[&F.getEntryBlock()];
-  for (Argument &Arg : F.args())
-    HeadValues.insert(&Arg);
+unsigned ReachableIntegerValues::numberBlock(DomTreeNode const *Node,
+                                             unsigned IDom) const {
+  unsigned Index = Blocks.size();
+  Blocks.push_back({IDom, static_cast<unsigned>(Values.size()), 0});
+  for (Instruction &Inst : *Node->getBlock())
+    if (Inst.getType()->isIntegerTy()) {
+      ValueNumbers[&Inst] = Values.size();
+      Values.push_back(&Inst);
+    }
+  Blocks.back().End = Values.size();
+  BlockIndices[Node->getBlock()] = Index;
+  return Index;
+}
 
-  // then use dominance tree to merge relevant sets
-  auto *Root =
-      getAnalysis<DominatorTreeWrapperPass>().getDomTree().getRootNode();
-  std::deque<decltype(Root)> NodesToProcess;
-  NodesToProcess.push_back(Root);
+unsigned
+ReachableIntegerValues::getBlockIndex(BasicBlock const *BB) const {
+  auto Where = BlockIndices.find(BB);
+  if (Where != BlockIndices.end())
+    return Where->second;
 
-  DEBUG(errs() << "In Function:\n" << F);
+  // unreachable blocks are not part of the dominator tree
+  auto *Node = DT->getNode(const_cast<BasicBlock *>(BB));
+  if (!Node)
+    return NoBlock;
 
-  while (!NodesToProcess.empty()) {
-    auto *NodeToProcess = NodesToProcess.back();
-    NodesToProcess.pop_back();
-    DEBUG(errs() << "processing BB " << NodeToProcess->getBlock() << "\n");
-    for (auto *Child : *NodeToProcess) {
-      DEBUG(errs() << "updating dominated child " << Child->getBlock() << "\n");
-      NodesToProcess.push_back(Child);
-      {
-        // add defined values to dominated nodes
-        auto &Values = DefinedValuesMap[NodeToProcess->getBlock()];
-        ReachableIntegerValuesMap[Child->getBlock()].insert(Values.begin(),
-                                                            Values.end());
-      }
-      {
-        // add inherited values from dominating node
-        auto &Values = ReachableIntegerValuesMap[NodeToProcess->getBlock()];
-        ReachableIntegerValuesMap[Child->getBlock()].insert(Values.begin(),
-                                                            Values.end());
-      }
+  // walk up the dominator tree until an already numbered block is found, then
+  // number the blocks met on the way, starting from the topmost one
+  SmallVector<DomTreeNode *, 8> Chain;
+  unsigned IDom = 0;
+  for (; Node; Node = Node->getIDom()) {
+    auto Where = BlockIndices.find(Node->getBlock());
+    if (Where != BlockIndices.end()) {
+      IDom = Where->second;
+      break;
     }
+    Chain.push_back(Node);
+  }
+  for (auto Iter = Chain.rbegin(), End = Chain.rend(); Iter != End; ++Iter) {
+    DEBUG(errs() << "lazily processing BB " << (*Iter)->getBlock() << "\n");
+    IDom = numberBlock(*Iter, IDom);
+  }
+  return IDom;
+}
+
+void ReachableIntegerValues::splitBlock(BasicBlock const *Head,
+                                        BasicBlock const *Tail) {
+  auto Where = BlockIndices.find(Head);
+  // not numbered yet, it will be from the dominator tree
+  if (Where == BlockIndices.end())
+    return;
+
+  // Tail takes over the range of Head, so that the blocks Head used to
+  // dominate now refer to Tail, and Head gets a new range in between.
+  unsigned TailIndex = Where->second;
+  unsigned HeadIndex = Blocks.size();
+  BlockInfo Info = Blocks[TailIndex];
+
+  // values that moved to Tail go to the end of the range
+  auto Begin = Values.begin() + Info.Begin, End = Values.begin() + Info.End;
+  auto Mid = std::stable_partition(Begin, End, [Head](Value const *V) {
+    return cast<Instruction>(V)->getParent() == Head;
+  });
+  for (auto Iter = Begin; Iter != End; ++Iter)
+    ValueNumbers[*Iter] = Iter - Values.begin();
+
+  unsigned Split = Mid - Values.begin();
+  Blocks.push_back({Info.IDom, Info.Begin, Split});
+  Blocks[TailIndex] = {HeadIndex, Split, Info.End};
+  BlockIndices[Head] = HeadIndex;
+  BlockIndices[Tail] = TailIndex;
+}
+
+void ReachableIntegerValues::addBlock(BasicBlock const *NewBB,
+                                      BasicBlock const *IDom) {
+  auto Where = BlockIndices.find(IDom);
+  // not numbered yet, NewBB will be numbered from the dominator tree
+  if (Where == BlockIndices.end())
+    return;
+  unsigned Index = Values.size();
+  BlockIndices[NewBB] = Blocks.size();
+  Blocks.push_back({Where->second, Index, Index});
+}
+
+void ReachableIntegerValues::replaceValue(Value *Old, Value *New) {
+  auto Where = ValueNumbers.find(Old);
+  if (Where == ValueNumbers.end())
+    return;
+  unsigned Number = Where->second;
+  ValueNumbers.erase(Where);
+  Values[Number] = New;
+  ValueNumbers[New] = Number;
+}
+
+void ReachableIntegerValues::removeValue(Instruction *I) {
+  auto Where = ValueNumbers.find(I);
+  if (Where == ValueNumbers.end())
+    return;
+  unsigned Number = Where->second;
+  ValueNumbers.erase(Where);
+
+  // move the last value of the range in place of the removed one, and shrink
+  // the range
+  BlockInfo &Info = Blocks[BlockIndices.lookup(I->getParent())];
+  assert(Info.Begin <= Number && Number < Info.End &&
+         "value not numbered in its parent block");
+  unsigned Last = --Info.End;
+  if (Number != Last) {
+    Values[Number] = Values[Last];
+    ValueNumbers[Values[Number]] = Number;
+  }
+}
+
+size_t ReachableIntegerValues::getReachableIntegerValuesCount(
+    BasicBlock const *BB) const {
+  unsigned Index = getBlockIndex(BB);
+  if (Index == NoBlock)
+    return 0;
+  // values defined in BB are not reachable from BB, only those from its
+  // dominators are
+  size_t Count = 0;
+  for (Index = Blocks[Index].IDom; Index != NoBlock;
+       Index = Blocks[Index].IDom)
+    Count += Blocks[Index].End - Blocks[Index].Begin;
+  return Count;
+}
+
+Value *
+ReachableIntegerValues::getReachableIntegerValue(BasicBlock const *BB,
+                                                 size_t Offset) const {
+  unsigned Index = getBlockIndex(BB);
+  assert(Index != NoBlock && "no value reachable from an unreachable block");
+  for (Index = Blocks[Index].IDom; Index != NoBlock;
+       Index = Blocks[Index].IDom) {
+    BlockInfo const &Info = Blocks[Index];
+    if (Offset < Info.End - Info.Begin)
+      return Values[Info.Begin + Offset];
+    Offset -= Info.End - Info.Begin;
+  }
+  llvm_unreachable("reachable integer value index out of range");
+}
+
+void ReachableIntegerValues::getReachableIntegerValues(
+    BasicBlock const *BB, SmallVectorImpl<Value *> &ReachableValues) const {
+  unsigned Index = getBlockIndex(BB);
+  if (Index == NoBlock)
+    return;
+  for (Index = Blocks[Index].IDom; Index != NoBlock;
+       Index = Blocks[Index].IDom)
+    ReachableValues.append(Values.begin() + Blocks[Index].Begin,
+                           Values.begin() + Blocks[Index].End);
+}
+
+void ReachableIntegerValues::print(raw_ostream &O) const {
+  SmallVector<Value *, 8> ReachableValues;
+  for(BasicBlock const& BB : *F) {
+    O << "BB " << &BB << '\n';
+    ReachableValues.clear();
+    getReachableIntegerValues(&BB, ReachableValues);
+    for(auto const* IntegerValue : ReachableValues)
+      O << "    " << *IntegerValue << '\n';
   }
+}
+
+/*****************************************
+ * New pass manager
+ *****************************************/
+
+char ReachableIntegerValuesAnalysis::PassID;
+
+ReachableIntegerValues
+ReachableIntegerValuesAnalysis::run(Function &F,
+                                    AnalysisManager<Function> *AM) {
+  return ReachableIntegerValues(F, AM->getResult<DominatorTreeAnalysis>(F));
+}
+
+/*****************************************
+ * Legacy pass manager
+ *****************************************/
+
+ReachableIntegerValuesPass::ReachableIntegerValuesPass() : FunctionPass(ID) {}
+
+bool ReachableIntegerValuesPass::runOnFunction(Function &F) {
+  // The same instance of the analysis is created and registered, then used
+  // repetitively, so its result is recomputed each time we enter
+  // runOnFunction
+  RIV.reset(new ReachableIntegerValues(
+      F, getAnalysis<DominatorTreeWrapperPass>().getDomTree()));
 
   // An analysis should not modify its argument
   return false;
@@ -86,23 +263,16 @@ void ReachableIntegerValuesPass::getAnalysisUsage(AnalysisUsage &Info) const {
   Info.setPreservesAll();
 }
 
-ReachableIntegerValuesPass::ReachableIntegerValuesMapTy const &
-ReachableIntegerValuesPass::getReachableIntegerValuesMap() const {
-  return ReachableIntegerValuesMap;
-}
-
 void ReachableIntegerValuesPass::print(raw_ostream &O, Module const*) const {
-  for(auto const& KV: ReachableIntegerValuesMap) {
-    O << "BB " << KV.first << '\n';
-    for(auto const& IntegerValue : KV.second)
-      O << "    " << *IntegerValue << '\n';
-  }
+  if (RIV)
+    RIV->print(O);
 }
 
 char ReachableIntegerValuesPass::ID = 0;
 static RegisterPass<ReachableIntegerValuesPass>
     X("reachable-integer-values",         // pass option
       "Compute Reachable Integer values", // pass description
-      true, // does not modify the CFG
-      true  // and it's an analysis
+      false, // holds values, so passes that only preserve the CFG
+             // invalidate it
+      true   // and it's an analysis
       );
@@ -0,0 +1,41 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb %s -S | FileCheck %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-branch-weights=false %s -S | FileCheck -check-prefix=CHECK-OFF %s
+
+@g = global i32 0
+
+; the only context value of body has its lowest bit set, so it is known not to
+; be null and the clone on the false branch is laid out first
+; CHECK-LABEL: body:
+; CHECK: br i1 %{{[^,]+}}, label %[[THEN:[^,]+]], label %[[ELSE:[^,]+]], !prof ![[WEIGHTS:[0-9]+]]
+; CHECK: <label>:[[ELSE]]{{$| }}
+; CHECK: <label>:[[THEN]]{{$| }}
+; CHECK-OFF-NOT: !prof
+define i32 @foo() {
+entry:
+  %x = or i32 ptrtoint (i32* @g to i32), 1
+  br label %body
+
+body:
+  %0 = or i32 %x, 2
+  br label %exit
+
+exit:
+  ret i32 %0
+}
+
+; nothing is known of the context values of bar, so no weights are given
+; CHECK-LABEL: @bar(
+; CHECK-NOT: !prof
+; CHECK: ![[WEIGHTS]] = !{!"branch_weights", i32 1, i32 1048576}
+define i32 @bar(i32 %a, i32 %b) {
+entry:
+  %x = add i32 %a, 1
+  br label %body
+
+body:
+  %0 = add i32 %x, %b
+  br label %exit
+
+exit:
+  ret i32 %0
+}
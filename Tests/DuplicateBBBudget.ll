@@ -0,0 +1,29 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-max-growth=100 %s -S | FileCheck -check-prefix=CHECK-SOME %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-max-growth=1 %s -S | FileCheck -check-prefix=CHECK-NONE %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-max-module-growth=1 %s -S | FileCheck -check-prefix=CHECK-NONE %s
+
+; the budget is spent on the small blocks, the loop body is too large
+; CHECK-SOME-LABEL: @foo(
+; CHECK-SOME: icmp eq
+; CHECK-SOME-LABEL: loop:
+; CHECK-SOME-NEXT: phi
+; CHECK-SOME-NEXT: xor
+; CHECK-NONE-LABEL: @foo(
+; CHECK-NONE-NOT: icmp eq
+define i32 @foo(i32 %n, i32 %k) {
+entry:
+  br label %loop
+
+loop:
+  %i = phi i32 [ %k, %entry ], [ %inc, %loop ]
+  %0 = xor i32 %i, %n
+  %1 = and i32 %0, 255
+  %2 = or i32 %1, %k
+  %3 = mul i32 %2, %i
+  %inc = add i32 %3, 1
+  %cmp = icmp slt i32 %inc, %n
+  br i1 %cmp, label %loop, label %exit
+
+exit:
+  ret i32 %inc
+}
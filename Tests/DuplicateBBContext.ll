@@ -0,0 +1,44 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-context=nearest -pass-remarks-analysis=duplicate-bb %s -disable-output 2>&1 | FileCheck %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -pass-remarks-analysis=duplicate-bb %s -disable-output 2>&1 | FileCheck -check-prefix=CHECK-RANDOM %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-loops=hoist -pass-remarks-analysis=duplicate-bb %s -disable-output 2>&1 | FileCheck -check-prefix=CHECK-HOIST %s
+
+; %y is the only value used by body, so it is picked rather than %x or the
+; arguments, whose live ranges would be extended
+; CHECK: remark: {{.*}}function=foo block=body context=y live-in=1 dominator-distance=1
+; CHECK-RANDOM: remark: {{.*}}function=foo block=body context={{[xyab]}} live-in={{[01]}} dominator-distance={{[0-9]+}}
+; the context value of a block of a loop is picked from the loop header when
+; the condition is hoisted, but the remark is about the block
+; CHECK-HOIST: remark: {{.*}}function=bar block=body context=n
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %x = add i32 %a, %b
+  %y = xor i32 %a, %b
+  br label %body
+
+body:
+  %z = add i32 %y, 1
+  br label %exit
+
+exit:
+  ret i32 %z
+}
+
+@g = global i32 0
+
+define i32 @bar() {
+entry:
+  %n = load i32, i32* @g
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %body ]
+  %cmp = icmp slt i32 %i, %n
+  br i1 %cmp, label %body, label %exit
+
+body:
+  %inc = add i32 %i, 1
+  br label %loop
+
+exit:
+  ret i32 %i
+}
@@ -0,0 +1,23 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb %s -S | FileCheck -check-prefix=CHECK-ALL %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-live-phis %s -S | FileCheck -check-prefix=CHECK-LIVE %s
+
+; %0 is only used within its block, so it does not need a phi once the block
+; is duplicated, unlike %1
+; CHECK-ALL-LABEL: @foo(
+; CHECK-ALL: phi
+; CHECK-ALL: phi
+; CHECK-LIVE-LABEL: @foo(
+; CHECK-LIVE: phi
+; CHECK-LIVE-NOT: phi
+define i32 @foo(i32 %i, i32 %j) {
+entry:
+  br label %body
+
+body:
+  %0 = xor i32 %i, %j
+  %1 = add i32 %0, 1
+  br label %exit
+
+exit:
+  ret i32 %1
+}
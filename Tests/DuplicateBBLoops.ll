@@ -0,0 +1,30 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb %s -S | FileCheck -check-prefix=CHECK-NONE %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-loops=skip-innermost %s -S | FileCheck -check-prefix=CHECK-SKIP %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-loops=hoist %s -S | FileCheck -check-prefix=CHECK-HOIST %s
+
+; by default, the condition is computed at each iteration
+; CHECK-NONE-LABEL: loop:
+; CHECK-NONE-NEXT: phi
+; CHECK-NONE-NEXT: icmp eq
+; the loop body is left untouched
+; CHECK-SKIP-LABEL: loop:
+; CHECK-SKIP-NEXT: phi
+; CHECK-SKIP-NEXT: add
+; the condition is computed before entering the loop
+; CHECK-HOIST-LABEL: loop:
+; CHECK-HOIST-NEXT: phi
+; CHECK-HOIST-NEXT: br i1
+define i32 @foo(i32 %n, i32 %k) {
+entry:
+  %m = mul i32 %n, %k
+  br label %loop
+
+loop:
+  %i = phi i32 [ %m, %entry ], [ %inc, %loop ]
+  %inc = add i32 %i, 1
+  %cmp = icmp slt i32 %inc, %n
+  br i1 %cmp, label %loop, label %exit
+
+exit:
+  ret i32 %inc
+}
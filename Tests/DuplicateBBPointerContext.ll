@@ -0,0 +1,18 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb %s -S | FileCheck %s
+
+; the only context value is a pointer argument, compared against null; nothing
+; is known of it, so the branch is not weighted
+; CHECK-LABEL: entry:
+; CHECK: icmp eq i8* %p, null
+; CHECK-NOT: !prof
+define i8* @foo(i8* %p) {
+entry:
+  br label %body
+
+body:
+  %q = getelementptr i8, i8* %p, i64 1
+  br label %exit
+
+exit:
+  ret i8* %q
+}
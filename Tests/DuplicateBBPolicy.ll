@@ -0,0 +1,39 @@
+; RUN: echo "fast_* duplicate-bb=0  # performance critical" > %t.policy
+; RUN: echo "*      duplicate-bb=1 mba=0.5" >> %t.policy
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-ratio=0 -duplicate-bb-policy=%t.policy %s -S | FileCheck %s
+; RUN: echo "foo duplicatebb=0" > %t.invalid
+; RUN: not opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-policy=%t.invalid %s -S 2>&1 | FileCheck -check-prefix=CHECK-ERROR %s
+
+; the first matching line sets the ratio of a function, unless it is
+; annotated; a misspelled pass is an error rather than a rule never applied
+; CHECK-ERROR: invalid:1: unknown pass `duplicatebb', expected mba or duplicate-bb
+
+@.str = private unnamed_addr constant [19 x i8] c"obf-duplicate-bb=0\00", section "llvm.metadata"
+@.str.1 = private unnamed_addr constant [4 x i8] c"t.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { i8*, i8*, i8*, i32 }] [{ i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @annotated to i8*), i8* getelementptr inbounds ([19 x i8], [19 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 1 }], section "llvm.metadata"
+
+; CHECK-LABEL: @foo(
+; CHECK: icmp eq
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+; CHECK-LABEL: @fast_foo(
+; CHECK-NOT: icmp
+; CHECK: ret i32
+define i32 @fast_foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+; CHECK-LABEL: @annotated(
+; CHECK-NOT: icmp
+; CHECK: ret i32
+define i32 @annotated(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
@@ -0,0 +1,17 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -pass-remarks-analysis=duplicate-bb %s -disable-output 2>&1 | FileCheck %s
+
+; one remark per function, as key=value pairs, at the location of the
+; function if it has debug information
+; CHECK: remark: {{.*}}function=foo cached=0 instructions-before=5 instructions-after={{[0-9]+}} duplicated-blocks={{[1-9][0-9]*}} phis={{[1-9][0-9]*}} time-us={{[0-9]+}}
+define i32 @foo(i32 %i, i32 %j) {
+entry:
+  br label %body
+
+body:
+  %0 = xor i32 %i, %j
+  %1 = add i32 %0, 1
+  br label %exit
+
+exit:
+  ret i32 %1
+}
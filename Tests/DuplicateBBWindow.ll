@@ -0,0 +1,35 @@
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-max-window=2 %s -S | FileCheck %s
+; RUN: opt -load %bindir/ReachableIntegerValues/LLVMReachableIntegerValues${MOD_EXT} -load %bindir/DuplicateBB/LLVMDuplicateBB${MOD_EXT} -duplicate-bb -duplicate-bb-max-window=2 %s -verify -disable-output
+
+; only two of the six instructions are duplicated, so they are the only ones
+; to need a phi
+; CHECK-LABEL: @foo(
+; CHECK: icmp eq
+; CHECK: phi
+; CHECK: phi
+; CHECK-NOT: phi
+; CHECK: ret
+; no integer value is reachable from the window of bar, so its block is not
+; split
+; CHECK-LABEL: @bar(
+; CHECK-NOT: br
+; CHECK: ret void
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %0 = add i32 %a, %b
+  %1 = xor i32 %0, %a
+  %2 = mul i32 %1, %b
+  %3 = sub i32 %2, %0
+  %4 = and i32 %3, %1
+  %5 = or i32 %4, %2
+  ret i32 %5
+}
+
+define void @bar() {
+entry:
+  %p = alloca i32
+  store i32 1, i32* %p
+  store i32 2, i32* %p
+  store i32 3, i32* %p
+  ret void
+}
@@ -0,0 +1,34 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba %s -S | FileCheck %s
+
+; shifts are cheaper than multiplications on these vectors, but shifting an
+; i1 by 1 is poison, so booleans only get the rules without shifts
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK-LABEL: @wide(
+; CHECK: shl <4 x i32>
+; CHECK: ret <4 x i32>
+define <4 x i32> @wide(<4 x i32> %a, <4 x i32> %b) {
+entry:
+  %add = add <4 x i32> %a, %b
+  ret <4 x i32> %add
+}
+
+; CHECK-LABEL: @bool(
+; CHECK-NOT: shl
+; CHECK: ret <4 x i1>
+define <4 x i1> @bool(<4 x i1> %a, <4 x i1> %b) {
+entry:
+  %add = add <4 x i1> %a, %b
+  ret <4 x i1> %add
+}
+
+; CHECK-LABEL: @scalar(
+; CHECK-NOT: shl
+; CHECK: ret i1
+define i1 @scalar(i1 %a, i1 %b) {
+entry:
+  %add = add i1 %a, %b
+  %sub = sub i1 %add, %b
+  %xor = xor i1 %sub, %a
+  ret i1 %xor
+}
@@ -0,0 +1,35 @@
+; RUN: rm -rf %t.cache
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-cache-dir=%t.cache %s -S -o %t.miss
+; RUN: ls %t.cache | FileCheck -check-prefix=CHECK-ENTRY %s
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-cache-dir=%t.cache %s -S -o %t.hit
+; RUN: diff %t.miss %t.hit
+; RUN: FileCheck %s < %t.hit
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-cache-dir=%t.cache -pass-remarks-analysis=mba %s -disable-output 2>&1 | FileCheck -check-prefix=CHECK-REMARK %s
+
+; a second run reads the obfuscated functions back from the cache, struct
+; types and internal globals being resolved in the module
+; CHECK-ENTRY: {{^[0-9a-f]+\.bc$}}
+; CHECK-ENTRY: {{^[0-9a-f]+\.bc$}}
+; CHECK-LABEL: @foo(
+; CHECK: mul
+; CHECK-LABEL: @bar(
+; CHECK: getelementptr inbounds %struct.pair, %struct.pair* @p
+; what was substituted in a cached function is not known
+; CHECK-REMARK: remark: {{.*}}function=foo cached=1 instructions-before=2 instructions-after={{[0-9]+}} substitutions=unknown cost=unknown
+
+%struct.pair = type { i32, i32 }
+
+@p = internal global %struct.pair zeroinitializer
+
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define i32 @bar(i32 %a) {
+entry:
+  %x = load i32, i32* getelementptr inbounds (%struct.pair, %struct.pair* @p, i32 0, i32 1)
+  %xor = xor i32 %x, %a
+  ret i32 %xor
+}
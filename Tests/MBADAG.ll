@@ -0,0 +1,17 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-dag %s -S | FileCheck -check-prefix=DAG %s
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba %s -S | FileCheck -check-prefix=NODAG %s
+
+; a & b == (~a | b) - ~a, where ~a is computed once in DAG mode
+; DAG-LABEL: @foo(
+; DAG: xor i32 %a, -1
+; DAG-NOT: xor
+; DAG: ret i32
+; NODAG-LABEL: @foo(
+; NODAG: xor i32 %a, -1
+; NODAG: xor i32 %a, -1
+; NODAG: ret i32
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %and = and i32 %a, %b
+  ret i32 %and
+}
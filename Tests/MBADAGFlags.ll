@@ -0,0 +1,15 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-dag -mba-max-growth=200 %s -S | FileCheck %s
+
+; the budget leaves %m alone, and a + b == (a ^ b) + 2 * (a & b) must not
+; reuse it for 2 * (a & b), as it is poison when the multiplication wraps
+; CHECK-LABEL: @foo(
+; CHECK: %m = mul nsw i32 2,
+; CHECK: mul i32 2,
+; CHECK: ret i32
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %and = and i32 %a, %b
+  %m = mul nsw i32 2, %and
+  %add = add i32 %a, %b
+  ret i32 %add
+}
@@ -0,0 +1,26 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-hot-threshold=4 %s -S | FileCheck %s
+
+; the loop body is hot, so it is kept as is
+; CHECK-LABEL: entry:
+; CHECK: mul
+; CHECK-LABEL: loop:
+; CHECK-NOT: mul
+; CHECK-LABEL: exit:
+define i32 @foo(i32 %n, i32 %k) {
+entry:
+  %init = add i32 %n, %k
+  br label %loop
+
+loop:
+  %i = phi i32 [ 0, %entry ], [ %inc, %loop ]
+  %acc = phi i32 [ %init, %entry ], [ %sum, %loop ]
+  %sum = add i32 %acc, %i
+  %inc = add i32 %i, 1
+  %cmp = icmp slt i32 %inc, %n
+  br i1 %cmp, label %loop, label %exit, !prof !0
+
+exit:
+  ret i32 %sum
+}
+
+!0 = !{!"branch_weights", i32 1000, i32 1}
@@ -0,0 +1,37 @@
+; RUN: echo "fast_* mba=0  # performance critical" > %t.policy
+; RUN: echo "*      mba=1 duplicate-bb=0.5" >> %t.policy
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-ratio=0 -mba-policy=%t.policy %s -S | FileCheck %s
+; RUN: echo "foo mba=2" > %t.invalid
+; RUN: not opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-policy=%t.invalid %s -S 2>&1 | FileCheck -check-prefix=CHECK-ERROR %s
+
+; the first matching line sets the ratio of a function, unless it is
+; annotated
+; CHECK-ERROR: invalid:1: `mba=2' is not a pass=ratio pair
+
+@.str = private unnamed_addr constant [10 x i8] c"obf-mba=0\00", section "llvm.metadata"
+@.str.1 = private unnamed_addr constant [4 x i8] c"t.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [1 x { i8*, i8*, i8*, i32 }] [{ i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @annotated to i8*), i8* getelementptr inbounds ([10 x i8], [10 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 1 }], section "llvm.metadata"
+
+; CHECK-LABEL: @foo(
+; CHECK: mul
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+; CHECK-LABEL: @fast_foo(
+; CHECK-NOT: mul
+define i32 @fast_foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+; CHECK-LABEL: @annotated(
+; CHECK-NOT: mul
+define i32 @annotated(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
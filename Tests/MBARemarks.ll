@@ -0,0 +1,17 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -pass-remarks-analysis=mba %s -disable-output 2>&1 | FileCheck %s
+
+; one remark per function, as key=value pairs, at the location of the
+; function if it has debug information
+; CHECK: remark: {{.*}}function=foo cached=0 instructions-before=2 instructions-after={{[0-9]+}} substitutions=1 cost={{[0-9]+}} time-us={{[0-9]+}}
+; CHECK: remark: {{.*}}function=bar cached=0 instructions-before=1 instructions-after=1 substitutions=0 cost=0 time-us={{[0-9]+}}
+
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define void @bar() {
+entry:
+  ret void
+}
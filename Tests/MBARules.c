@@ -0,0 +1,23 @@
+// RUN: clang %s -O2 -S -emit-llvm -o %t.ll
+// RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba %t.ll -S -o %t0.ll
+// RUN: clang %t0.ll -o %t0
+// RUN: %t0 12 5 17 7 9 13 4 60
+// RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-complexity=0 %t.ll -S -o %t1.ll
+// RUN: clang %t1.ll -o %t1
+// RUN: %t1 12 5 17 7 9 13 4 60
+// RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-complexity=100 %t.ll -S -o %t2.ll
+// RUN: clang %t2.ll -o %t2
+// RUN: %t2 12 5 17 7 9 13 4 60
+#include <stdlib.h>
+int main(int argc, char * argv[]) {
+  if(argc != 9)
+    return 1;
+  unsigned a = atoi(argv[1]),
+           b = atoi(argv[2]);
+  return (a + b != (unsigned)atoi(argv[3])) |
+         (a - b != (unsigned)atoi(argv[4])) |
+         ((a ^ b) != (unsigned)atoi(argv[5])) |
+         ((a | b) != (unsigned)atoi(argv[6])) |
+         ((a & b) != (unsigned)atoi(argv[7])) |
+         (a * b != (unsigned)atoi(argv[8]));
+}
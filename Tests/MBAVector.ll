@@ -0,0 +1,20 @@
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba -mba-ratio=1 %s -S | FileCheck %s
+
+; vector operations are substituted lane-wise, with splatted constants
+; CHECK-LABEL: @foo(
+; CHECK: mul <4 x i32> <i32 2, i32 2, i32 2, i32 2>
+; CHECK: ret <4 x i32>
+define <4 x i32> @foo(<4 x i32> %a, <4 x i32> %b) {
+entry:
+  %add = add <4 x i32> %a, %b
+  ret <4 x i32> %add
+}
+
+; CHECK-LABEL: @bar(
+; CHECK: xor <2 x i64> %{{.*}}, <i64 -1, i64 -1>
+; CHECK: ret <2 x i64>
+define <2 x i64> @bar(<2 x i64> %a, <2 x i64> %b) {
+entry:
+  %and = and <2 x i64> %a, %b
+  ret <2 x i64> %and
+}
@@ -0,0 +1,58 @@
+; RUN: %bindir/Obfuscator/obfuscate -mba -partitions=4 -j=2 %s -S -o %t
+; RUN: FileCheck %s < %t
+; RUN: FileCheck -check-prefix=CHECK-A1 %s < %t
+; RUN: FileCheck -check-prefix=CHECK-A2 %s < %t
+; RUN: FileCheck -check-prefix=CHECK-A3 %s < %t
+; RUN: FileCheck -check-prefix=CHECK-A4 %s < %t
+
+; SplitModule keeps the annotations in a single partition, the functions
+; of the other ones must still see theirs. Partitions may reorder the
+; functions, so each one is checked on its own.
+; CHECK-LABEL: define i32 @plain(
+; CHECK: mul
+; CHECK-A1-LABEL: define i32 @a1(
+; CHECK-A1-NOT: mul
+; CHECK-A1: ret i32
+; CHECK-A2-LABEL: define i32 @a2(
+; CHECK-A2-NOT: mul
+; CHECK-A2: ret i32
+; CHECK-A3-LABEL: define i32 @a3(
+; CHECK-A3-NOT: mul
+; CHECK-A3: ret i32
+; CHECK-A4-LABEL: define i32 @a4(
+; CHECK-A4-NOT: mul
+; CHECK-A4: ret i32
+
+@.str = private unnamed_addr constant [10 x i8] c"obf-mba=0\00", section "llvm.metadata"
+@.str.1 = private unnamed_addr constant [4 x i8] c"t.c\00", section "llvm.metadata"
+@llvm.global.annotations = appending global [4 x { i8*, i8*, i8*, i32 }] [{ i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @a1 to i8*), i8* getelementptr inbounds ([10 x i8], [10 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 1 }, { i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @a2 to i8*), i8* getelementptr inbounds ([10 x i8], [10 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 2 }, { i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @a3 to i8*), i8* getelementptr inbounds ([10 x i8], [10 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 3 }, { i8*, i8*, i8*, i32 } { i8* bitcast (i32 (i32, i32)* @a4 to i8*), i8* getelementptr inbounds ([10 x i8], [10 x i8]* @.str, i32 0, i32 0), i8* getelementptr inbounds ([4 x i8], [4 x i8]* @.str.1, i32 0, i32 0), i32 4 }], section "llvm.metadata"
+
+define i32 @plain(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define i32 @a1(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define i32 @a2(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define i32 @a3(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
+
+define i32 @a4(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
@@ -0,0 +1,25 @@
+; RUN: rm -rf %t.dir && mkdir -p %t.dir/in
+; RUN: cp %s %t.dir/in/first.ll && cp %s %t.dir/in/second.ll
+; RUN: %bindir/Obfuscator/obfuscate -mba -j=2 -output-dir=%t.dir/out %t.dir/in/first.ll %t.dir/in/second.ll
+; RUN: FileCheck %s < %t.dir/out/first.ll
+; RUN: FileCheck %s < %t.dir/out/second.ll
+; RUN: %bindir/Obfuscator/obfuscate -mba -i %t.dir/in/first.ll
+; RUN: diff %t.dir/in/first.ll %t.dir/out/first.ll
+; RUN: not %bindir/Obfuscator/obfuscate -mba %t.dir/in/first.ll %t.dir/in/second.ll
+; RUN: touch %t.dir/target.ll && ln -s %t.dir/target.ll %t.dir/link.ll
+; RUN: %bindir/Obfuscator/obfuscate -mba -S %s -o %t.dir/link.ll
+; RUN: test -L %t.dir/link.ll
+; RUN: FileCheck %s < %t.dir/target.ll
+; RUN: %bindir/Obfuscator/obfuscate -mba %s -o /dev/null
+
+; the outputs keep the format of their input, and the same file is obfuscated
+; the same way in place or in a directory. -o writes through symbolic links
+; and to devices.
+; CHECK-LABEL: define i32 @foo(
+; CHECK: mul
+
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  ret i32 %add
+}
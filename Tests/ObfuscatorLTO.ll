@@ -0,0 +1,20 @@
+; RUN: echo 'define i32 @add(i32 %lhs, i32 %rhs) { %r = add i32 %lhs, %rhs ret i32 %r }' > %t.add.ll
+; RUN: %bindir/Obfuscator/obfuscate -lto -mba -S -o %t.ll %s %t.add.ll
+; RUN: FileCheck %s < %t.ll
+; RUN: not %bindir/Obfuscator/obfuscate -lto -mba -i %s %t.add.ll
+
+; @add is inlined into @foo by the link time optimizations, then obfuscated
+; there, as in @add itself
+; CHECK-LABEL: define i32 @foo(
+; CHECK-NOT: call
+; CHECK: mul
+; CHECK-LABEL: define i32 @add(
+; CHECK: mul
+
+declare i32 @add(i32, i32)
+
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %c = call i32 @add(i32 %a, i32 %b)
+  ret i32 %c
+}
@@ -0,0 +1,27 @@
+; RUN: %bindir/Obfuscator/obfuscate -mba -duplicate-bb %s -S -o %t.legacy
+; RUN: %bindir/Obfuscator/obfuscate -new-pm -mba -duplicate-bb %s -S -o %t.new
+; RUN: diff %t.legacy %t.new
+; RUN: FileCheck %s < %t.new
+; RUN: %bindir/Obfuscator/obfuscate -new-pm -mba -duplicate-bb -duplicate-bb-loops=hoist -partitions=2 %s -S | FileCheck %s
+; RUN: not %bindir/Obfuscator/obfuscate -new-pm -instcombine %s -S -o %t.error
+
+; both pass managers run the same code, with the same random numbers
+; CHECK-LABEL: define i32 @foo(
+; CHECK: phi
+; CHECK: mul
+define i32 @foo(i32 %i, i32 %j) {
+entry:
+  br label %while.cond
+
+while.cond:
+  %iaddr = phi i32 [ %i, %entry ], [ %add, %while.cond ]
+  %0 = xor i32 %iaddr, %j
+  %1 = and i32 %0, 255
+  %cmp = icmp eq i32 %1, 0
+  %add = add i32 %iaddr, %j
+  br i1 %cmp, label %while.end, label %while.cond
+
+while.end:
+  %iaddr.lcssa = phi i32 [ %iaddr, %while.cond ]
+  ret i32 %iaddr.lcssa
+}
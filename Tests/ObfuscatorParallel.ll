@@ -0,0 +1,44 @@
+; RUN: %bindir/Obfuscator/obfuscate -mba -duplicate-bb -partitions=3 -j=1 %s -S -o %t.1
+; RUN: %bindir/Obfuscator/obfuscate -mba -duplicate-bb -partitions=3 -j=3 %s -S -o %t.3
+; RUN: diff %t.1 %t.3
+; RUN: FileCheck %s < %t.3
+
+; the output does not depend on the number of threads, and local symbols stay
+; local once the partitions are linked back
+; CHECK-DAG: define internal i32 @helper(
+; CHECK-DAG: define i32 @foo(
+; CHECK-DAG: define i32 @bar(
+; CHECK-DAG: define i32 @baz(
+; CHECK-DAG: mul
+
+@counter = internal global i32 0
+
+define internal i32 @helper(i32 %a, i32 %b) {
+entry:
+  %add = add i32 %a, %b
+  %old = load i32, i32* @counter
+  %new = add i32 %old, %add
+  store i32 %new, i32* @counter
+  ret i32 %new
+}
+
+define i32 @foo(i32 %a, i32 %b) {
+entry:
+  %call = call i32 @helper(i32 %a, i32 %b)
+  %sub = sub i32 %call, %a
+  ret i32 %sub
+}
+
+define i32 @bar(i32 %a, i32 %b) {
+entry:
+  %xor = xor i32 %a, %b
+  %call = call i32 @helper(i32 %xor, i32 %b)
+  ret i32 %call
+}
+
+define i32 @baz(i32 %a, i32 %b) {
+entry:
+  %and = and i32 %a, %b
+  %or = or i32 %and, %b
+  ret i32 %or
+}
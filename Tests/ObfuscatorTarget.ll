@@ -0,0 +1,18 @@
+; RUN: %bindir/Obfuscator/obfuscate -mba %s -S -o %t.obfuscate
+; RUN: opt -load %bindir/MBA/LLVMMBA${MOD_EXT} -mba %s -S -o %t.opt
+; RUN: FileCheck %s < %t.obfuscate
+; RUN: FileCheck %s < %t.opt
+
+; both tools pick the rules after the cost model of the target, where shifts
+; are cheaper than multiplications on these vectors
+target triple = "x86_64-unknown-linux-gnu"
+
+; CHECK-LABEL: @foo(
+; CHECK: shl <4 x i32>
+; CHECK-NOT: mul
+; CHECK: ret <4 x i32>
+define <4 x i32> @foo(<4 x i32> %a, <4 x i32> %b) {
+entry:
+  %add = add <4 x i32> %a, %b
+  ret <4 x i32> %add
+}
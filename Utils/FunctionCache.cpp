@@ -0,0 +1,302 @@
+#include "FunctionCache.h"
+#include "Utils.h"
+
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SetVector.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallString.h"
+#include "llvm/Bitcode/ReaderWriter.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/DerivedTypes.h"
+#include "llvm/IR/Function.h"
+#include "llvm/IR/GlobalVariable.h"
+#include "llvm/IR/Metadata.h"
+#include "llvm/IR/Module.h"
+#include "llvm/IR/TypeFinder.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MD5.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Transforms/Utils/Cloning.h"
+#include "llvm/Transforms/Utils/ValueMapper.h"
+
+using namespace llvm;
+
+// Struct types are renamed when an entry is read back in a context that
+// already holds types of the same name, so their original names are recorded
+// in the entry
+static char const TypeNamesMD[] = "obfuscation.cache.types";
+
+namespace {
+
+// The globals and the types F refers to, and whether it can be cached
+class References {
+  SmallPtrSet<Type *, 16> VisitedTypes;
+  SmallPtrSet<Constant *, 16> VisitedConstants;
+
+  void addType(Type *Ty) {
+    if (not VisitedTypes.insert(Ty).second)
+      return;
+    if (auto *ST = dyn_cast<StructType>(Ty))
+      if (not ST->isLiteral() and not ST->hasName())
+        Cacheable = false;
+    for (Type *Sub : Ty->subtypes())
+      addType(Sub);
+  }
+
+  void addConstant(Constant *C) {
+    if (not VisitedConstants.insert(C).second)
+      return;
+    addType(C->getType());
+    if (auto *GV = dyn_cast<GlobalValue>(C)) {
+      if (not GV->hasName())
+        Cacheable = false;
+      Globals.insert(GV);
+    } else if (isa<BlockAddress>(C)) {
+      // refers to a basic block of some function
+      Cacheable = false;
+    } else {
+      for (Value *Op : C->operands())
+        addConstant(cast<Constant>(Op));
+    }
+  }
+
+public:
+  SetVector<GlobalValue *> Globals;
+  bool Cacheable = true;
+
+  References(Function const &F) {
+    // debug information is tied to its compile unit
+    if (F.getSubprogram())
+      Cacheable = false;
+    addType(F.getFunctionType());
+    if (F.hasPersonalityFn())
+      addConstant(F.getPersonalityFn());
+    for (BasicBlock const &BB : F)
+      for (Instruction const &I : BB) {
+        if (I.getDebugLoc())
+          Cacheable = false;
+        addType(I.getType());
+        for (Value *Op : I.operands()) {
+          addType(Op->getType());
+          if (auto *C = dyn_cast<Constant>(Op))
+            addConstant(C);
+        }
+      }
+  }
+};
+
+// Maps the struct types of an entry to the ones of the module it is read in
+class StructTypeRemapper : public ValueMapTypeRemapper {
+  DenseMap<Type *, Type *> Map;
+
+public:
+  void add(StructType *From, StructType *To) { Map[From] = To; }
+
+  Type *remapType(Type *Ty) override {
+    auto Where = Map.find(Ty);
+    if (Where != Map.end())
+      return Where->second;
+
+    // named structs not in the map are left as is, others are rebuilt from
+    // their remapped elements
+    Type *Result = Ty;
+    auto *ST = dyn_cast<StructType>(Ty);
+    if (Ty->getNumContainedTypes() and (not ST or ST->isLiteral())) {
+      SmallVector<Type *, 4> Elements;
+      bool Changed = false;
+      for (Type *Sub : Ty->subtypes()) {
+        Elements.push_back(remapType(Sub));
+        Changed |= Elements.back() != Sub;
+      }
+      if (Changed) {
+        switch (Ty->getTypeID()) {
+        case Type::PointerTyID:
+          Result = PointerType::get(Elements[0], Ty->getPointerAddressSpace());
+          break;
+        case Type::ArrayTyID:
+          Result = ArrayType::get(Elements[0], Ty->getArrayNumElements());
+          break;
+        case Type::VectorTyID:
+          Result = VectorType::get(Elements[0], Ty->getVectorNumElements());
+          break;
+        case Type::FunctionTyID:
+          Result = FunctionType::get(Elements[0],
+                                     makeArrayRef(Elements).slice(1),
+                                     cast<FunctionType>(Ty)->isVarArg());
+          break;
+        case Type::StructTyID:
+          Result = StructType::get(Ty->getContext(), Elements, ST->isPacked());
+          break;
+        default:
+          llvm_unreachable("unexpected derived type");
+        }
+      }
+    }
+    return Map[Ty] = Result;
+  }
+};
+}
+
+// A module holding a copy of F, and declarations of the globals it refers to,
+// in the same context, so that types are shared
+static std::unique_ptr<Module> extractFunction(Function const &F,
+                                               References const &Refs) {
+  Module const &M = *F.getParent();
+  auto Extracted = llvm::make_unique<Module>("", M.getContext());
+  Extracted->setTargetTriple(M.getTargetTriple());
+  Extracted->setDataLayout(M.getDataLayout());
+
+  ValueToValueMapTy VMap;
+  for (GlobalValue *GV : Refs.Globals) {
+    if (GV == &F)
+      continue;
+    GlobalValue *Decl;
+    if (auto *FT = dyn_cast<FunctionType>(GV->getValueType()))
+      Decl = Function::Create(FT, GlobalValue::ExternalLinkage, GV->getName(),
+                              Extracted.get());
+    else
+      Decl = new GlobalVariable(*Extracted, GV->getValueType(), false,
+                                GlobalValue::ExternalLinkage, nullptr,
+                                GV->getName(), nullptr,
+                                GlobalValue::NotThreadLocal,
+                                GV->getType()->getAddressSpace());
+    VMap[GV] = Decl;
+  }
+
+  Function *Copy =
+      Function::Create(F.getFunctionType(), GlobalValue::ExternalLinkage,
+                       F.getName(), Extracted.get());
+  VMap[&F] = Copy;
+  auto CopyArg = Copy->arg_begin();
+  for (Argument const &Arg : F.args())
+    VMap[&Arg] = &*CopyArg++;
+
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(Copy, &F, VMap, true, Returns);
+  return Extracted;
+}
+
+std::string FunctionCache::getKey(Function const &F,
+                                  StringRef FunctionOptions) const {
+  if (F.isDeclaration())
+    return "";
+  References Refs(F);
+  if (not Refs.Cacheable)
+    return "";
+
+  // The bitcode of the function alone captures its body, its attributes,
+  // its metadata and the types it uses, independently of the rest of the
+  // module. The first random number identifies the seed, and the names
+  // the function is obfuscated under.
+  SmallString<0> Buffer;
+  {
+    raw_svector_ostream OS(Buffer);
+    WriteBitcodeToFile(extractFunction(F, Refs).get(), OS);
+    OS << PassName << '\0' << Options << '\0' << FunctionOptions << '\0'
+       << compat::createRNG(PassName, F).at(0);
+  }
+
+  MD5 Hash;
+  Hash.update(Buffer);
+  MD5::MD5Result Result;
+  Hash.final(Result);
+  SmallString<32> Key;
+  MD5::stringifyResult(Result, Key);
+  return Key.str();
+}
+
+bool FunctionCache::lookup(Function &F, StringRef Key) const {
+  SmallString<128> Path(Directory);
+  sys::path::append(Path, Key + ".bc");
+  ErrorOr<std::unique_ptr<MemoryBuffer>> Buffer = MemoryBuffer::getFile(Path);
+  if (not Buffer)
+    return false;
+  ErrorOr<std::unique_ptr<Module>> Entry =
+      parseBitcodeFile((*Buffer)->getMemBufferRef(), F.getContext());
+  if (not Entry)
+    return false;
+
+  Module &M = *F.getParent();
+  Function *Cached = (*Entry)->getFunction(F.getName());
+  if (not Cached or Cached->isDeclaration())
+    return false;
+
+  StructTypeRemapper Remapper;
+  if (NamedMDNode *TypeNames = (*Entry)->getNamedMetadata(TypeNamesMD))
+    for (MDNode *TypeName : TypeNames->operands()) {
+      auto *Name = cast<MDString>(TypeName->getOperand(0));
+      auto *Ty = cast<StructType>(
+          cast<ConstantAsMetadata>(TypeName->getOperand(1))
+              ->getType()
+              ->getPointerElementType());
+      StructType *Original = M.getTypeByName(Name->getString());
+      if (not Original)
+        return false;
+      Remapper.add(Ty, Original);
+    }
+
+  // globals are resolved by name
+  ValueToValueMapTy VMap;
+  for (Function &G : **Entry)
+    if (&G != Cached) {
+      GlobalValue *Original = M.getNamedValue(G.getName());
+      if (not Original or Original->getType() != Remapper.remapType(G.getType()))
+        return false;
+      VMap[&G] = Original;
+    }
+  for (GlobalVariable &G : (*Entry)->globals()) {
+    GlobalValue *Original = M.getNamedValue(G.getName());
+    if (not Original or Original->getType() != Remapper.remapType(G.getType()))
+      return false;
+    VMap[&G] = Original;
+  }
+  VMap[Cached] = &F;
+  auto Arg = F.arg_begin();
+  for (Argument &CachedArg : Cached->args())
+    VMap[&CachedArg] = &*Arg++;
+
+  // deleting the body resets the linkage
+  GlobalValue::LinkageTypes Linkage = F.getLinkage();
+  F.deleteBody();
+  F.setLinkage(Linkage);
+
+  SmallVector<ReturnInst *, 4> Returns;
+  CloneFunctionInto(&F, Cached, VMap, true, Returns, "", nullptr, &Remapper);
+  return true;
+}
+
+void FunctionCache::store(Function const &F, StringRef Key) const {
+  References Refs(F);
+  if (not Refs.Cacheable)
+    return;
+  std::unique_ptr<Module> Entry = extractFunction(F, Refs);
+
+  TypeFinder Types;
+  Types.run(*Entry, true);
+  LLVMContext &Context = Entry->getContext();
+  NamedMDNode *TypeNames = Entry->getOrInsertNamedMetadata(TypeNamesMD);
+  for (StructType *Ty : Types)
+    TypeNames->addOperand(MDNode::get(
+        Context, {MDString::get(Context, Ty->getName()),
+                  ConstantAsMetadata::get(
+                      UndefValue::get(PointerType::getUnqual(Ty)))}));
+
+  // written to a temporary file first, so that concurrent builds never read
+  // a partial entry
+  if (sys::fs::create_directories(Directory))
+    return;
+  SmallString<128> TmpPath(Directory), Path(Directory);
+  sys::path::append(TmpPath, Key + "-%%%%%%.tmp");
+  sys::path::append(Path, Key + ".bc");
+  int FD;
+  if (sys::fs::createUniqueFile(TmpPath, FD, TmpPath))
+    return;
+  {
+    raw_fd_ostream OS(FD, true);
+    WriteBitcodeToFile(Entry.get(), OS);
+  }
+  if (sys::fs::rename(TmpPath, Path))
+    sys::fs::remove(TmpPath);
+}
@@ -1,5 +1,15 @@
 #include "Utils.h"
 
+#include "llvm/Analysis/BlockFrequencyInfo.h"
+#include "llvm/IR/DebugInfoMetadata.h"
+#include "llvm/IR/DiagnosticInfo.h"
+#include "llvm/IR/Constants.h"
+#include "llvm/IR/Module.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+
+#include <algorithm>
+
 // cl parser specialisation for the Ratio type
 //
 // See http://llvm.org/docs/CommandLine.html#extending-the-library
@@ -33,3 +43,290 @@ void parser<Ratio>::printOptionDiff(const Option &O, Ratio const &,
 }
 }
 }
+
+// A ratio in [0., 1.]
+static bool parseRatio(llvm::StringRef Text, double &Value) {
+  std::string Str = Text.str();
+  char *EndPtr = nullptr;
+  Value = std::strtod(Str.c_str(), &EndPtr);
+  return not Str.empty() and *EndPtr == '\0' and 0. <= Value and Value <= 1.;
+}
+
+// Whether Name matches Glob, where `*' matches any sequence of characters
+// and `?' any character
+static bool matchGlob(llvm::StringRef Glob, llvm::StringRef Name) {
+  // backtrack to the last star only, which is enough for globs
+  size_t G = 0, N = 0, Star = llvm::StringRef::npos, Resume = 0;
+  while (N < Name.size()) {
+    if (G < Glob.size() and (Glob[G] == '?' or Glob[G] == Name[N])) {
+      ++G;
+      ++N;
+    } else if (G < Glob.size() and Glob[G] == '*') {
+      Star = G++;
+      Resume = N;
+    } else if (Star != llvm::StringRef::npos) {
+      G = Star + 1;
+      N = ++Resume;
+    } else {
+      return false;
+    }
+  }
+  while (G < Glob.size() and Glob[G] == '*')
+    ++G;
+  return G == Glob.size();
+}
+
+bool ObfuscationPolicy::load(llvm::StringRef Filename, std::string &Error) {
+  llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>> Buffer =
+      llvm::MemoryBuffer::getFile(Filename);
+  if (std::error_code EC = Buffer.getError()) {
+    Error = (Filename + ": " + EC.message()).str();
+    return false;
+  }
+
+  auto NewRules = std::make_shared<llvm::StringMap<PassRules>>();
+  llvm::SmallVector<llvm::StringRef, 16> Lines;
+  (*Buffer)->getBuffer().split(Lines, '\n');
+  for (unsigned Line = 0; Line < Lines.size(); ++Line) {
+    llvm::StringRef Text = Lines[Line].split('#').first;
+    llvm::SmallVector<llvm::StringRef, 4> Fields;
+    Text.split(Fields, ' ', -1, false);
+    // tabs are separators too
+    llvm::SmallVector<llvm::StringRef, 4> Tokens;
+    for (llvm::StringRef Field : Fields)
+      Field.split(Tokens, '\t', -1, false);
+    for (llvm::StringRef &Token : Tokens)
+      Token = Token.trim();
+    if (Tokens.empty())
+      continue;
+
+    auto Fail = [&](llvm::Twine const &Message) {
+      Error = (Filename + ":" + llvm::Twine(Line + 1) + ": " + Message).str();
+      return false;
+    };
+    if (Tokens.size() == 1)
+      return Fail("expected pass=ratio pairs after `" + Tokens[0] + "'");
+
+    llvm::StringRef Glob = Tokens[0];
+    for (llvm::StringRef Token : llvm::makeArrayRef(Tokens).slice(1)) {
+      std::pair<llvm::StringRef, llvm::StringRef> PassAndRatio =
+          Token.split('=');
+      Rule R{Line, 0.};
+      if (PassAndRatio.first.empty() or
+          not parseRatio(PassAndRatio.second, R.Ratio))
+        return Fail("`" + Token + "' is not a pass=ratio pair, with a ratio "
+                                  "in [0., 1.]");
+      if (PassAndRatio.first != "mba" and PassAndRatio.first != "duplicate-bb")
+        return Fail("unknown pass `" + PassAndRatio.first +
+                    "', expected mba or duplicate-bb");
+      PassRules &PR = (*NewRules)[PassAndRatio.first];
+      if (Glob.find_first_of("*?") == llvm::StringRef::npos)
+        PR.Names.insert(std::make_pair(Glob, R));
+      else
+        PR.Globs.emplace_back(Glob, R);
+    }
+  }
+
+  Rules = std::move(NewRules);
+  this->Filename = Filename.str();
+  return true;
+}
+
+bool ObfuscationPolicy::lookup(llvm::StringRef Pass, llvm::StringRef Name,
+                               double &Ratio) const {
+  if (not Rules)
+    return false;
+  auto Where = Rules->find(Pass);
+  if (Where == Rules->end())
+    return false;
+  PassRules const &PR = Where->getValue();
+
+  // a glob only takes precedence over the name if it comes first
+  Rule const *Match = nullptr;
+  auto Named = PR.Names.find(Name);
+  if (Named != PR.Names.end())
+    Match = &Named->getValue();
+  for (auto const &Glob : PR.Globs) {
+    if (Match and Glob.second.Line > Match->Line)
+      break;
+    if (matchGlob(Glob.first, Name)) {
+      Match = &Glob.second;
+      break;
+    }
+  }
+  if (not Match)
+    return false;
+  Ratio = Match->Ratio;
+  return true;
+}
+
+namespace llvm {
+namespace cl {
+
+bool parser<ObfuscationPolicy>::parse(Option &O, StringRef ArgName,
+                                      const std::string &Arg,
+                                      ObfuscationPolicy &Val) {
+  std::string Error;
+  if (not Val.load(Arg, Error))
+    return O.error(Error);
+  return false;
+}
+
+void parser<ObfuscationPolicy>::printOptionDiff(
+    const Option &O, ObfuscationPolicy const &,
+    OptionValue<ObfuscationPolicy>, size_t GlobalWidth) const {
+  printOptionName(O, GlobalWidth);
+}
+}
+}
+
+void getFunctionAnnotations(
+    llvm::Module const &M,
+    llvm::SmallVectorImpl<std::pair<llvm::Function const *, llvm::StringRef>>
+        &Annotations) {
+  // clang gathers the annotations in a global array of
+  // { annotated value, annotation, file, line }
+  llvm::GlobalVariable const *Global =
+      M.getNamedGlobal("llvm.global.annotations");
+  if (not Global or not Global->hasInitializer())
+    return;
+  auto *Array = llvm::dyn_cast<llvm::ConstantArray>(Global->getInitializer());
+  if (not Array)
+    return;
+
+  for (llvm::Value const *Op : Array->operands()) {
+    auto *Entry = llvm::dyn_cast<llvm::ConstantStruct>(Op);
+    if (not Entry or Entry->getNumOperands() < 2)
+      continue;
+    auto *F = llvm::dyn_cast<llvm::Function>(
+        Entry->getOperand(0)->stripPointerCasts());
+    auto *String = llvm::dyn_cast<llvm::GlobalVariable>(
+        Entry->getOperand(1)->stripPointerCasts());
+    if (not F or not String or not String->hasInitializer())
+      continue;
+    auto *Data =
+        llvm::dyn_cast<llvm::ConstantDataSequential>(String->getInitializer());
+    if (not Data or not Data->isCString())
+      continue;
+    Annotations.push_back(std::make_pair(F, Data->getAsCString()));
+  }
+}
+
+FunctionRatios::FunctionRatios(llvm::Module const &M, llvm::StringRef Pass,
+                               ObfuscationPolicy const &Policy, double Default)
+    : Policy(&Policy), Pass(Pass), Default(Default) {
+  llvm::SmallVector<std::pair<llvm::Function const *, llvm::StringRef>, 8>
+      Annotations;
+  getFunctionAnnotations(M, Annotations);
+
+  std::string Prefix = ("obf-" + Pass + "=").str();
+  for (auto const &FunctionAnnotation : Annotations) {
+    llvm::Function const *F = FunctionAnnotation.first;
+    llvm::StringRef Annotation = FunctionAnnotation.second;
+    if (not Annotation.startswith(Prefix))
+      continue;
+    double Ratio;
+    if (not parseRatio(Annotation.substr(Prefix.size()), Ratio)) {
+      M.getContext().emitError("invalid annotation `" + Annotation + "' on " +
+                               F->getName() + ", the ratio must be in [0., 1.]");
+      continue;
+    }
+    Annotated[F] = Ratio;
+  }
+}
+
+double FunctionRatios::get(llvm::Function const &F) const {
+  auto Where = Annotated.find(&F);
+  if (Where != Annotated.end())
+    return Where->second;
+  double Ratio;
+  if (Policy and Policy->lookup(Pass, F.getName(), Ratio))
+    return Ratio;
+  return Default;
+}
+
+double getBlockRatio(llvm::BasicBlock const &BB,
+                     llvm::BlockFrequencyInfo const *BFI, double Ratio,
+                     double HotThreshold, double HotRatio) {
+  if (!BFI or HotThreshold <= 0.)
+    return Ratio;
+  double Frequency =
+      static_cast<double>(BFI->getBlockFreq(&BB).getFrequency()) /
+      BFI->getEntryFreq();
+  return Frequency > HotThreshold ? std::min(Ratio, HotRatio) : Ratio;
+}
+
+uint64_t getInstructionCount(llvm::Function const &F) {
+  uint64_t Count = 0;
+  for (llvm::BasicBlock const &BB : F)
+    Count += BB.size();
+  return Count;
+}
+
+uint64_t getInstructionCount(llvm::Module const &M) {
+  uint64_t Count = 0;
+  for (llvm::Function const &F : M)
+    Count += getInstructionCount(F);
+  return Count;
+}
+
+bool areRemarksEnabled(char const *PassName, llvm::Function const &F) {
+  return llvm::DiagnosticInfoOptimizationRemarkAnalysis(PassName, F,
+                                                        llvm::DebugLoc(), "")
+      .isEnabled();
+}
+
+constexpr uint64_t FunctionReport::Unknown;
+
+void FunctionReport::emit(
+    char const *PassName, llvm::Function const &F,
+    llvm::ArrayRef<std::pair<char const *, uint64_t>> Values) const {
+  auto Elapsed = std::chrono::duration_cast<std::chrono::microseconds>(
+      std::chrono::steady_clock::now() - Start);
+
+  std::string Message;
+  llvm::raw_string_ostream OS(Message);
+  OS << "function=" << F.getName();
+  for (auto const &Value : Values) {
+    OS << ' ' << Value.first << '=';
+    if (Value.second == Unknown)
+      OS << "unknown";
+    else
+      OS << Value.second;
+  }
+  OS << " time-us=" << Elapsed.count();
+
+  // located at the function, when it has debug information
+  llvm::DebugLoc Loc;
+  if (llvm::DISubprogram *SP = F.getSubprogram())
+    Loc = llvm::DebugLoc::get(SP->getLine(), 0, SP);
+  llvm::emitOptimizationRemarkAnalysis(F.getContext(), PassName, F, Loc,
+                                       OS.str());
+}
+
+namespace compat {
+
+constexpr uint64_t RandomNumberGenerator::Gamma;
+
+RandomNumberGenerator RandomNumberGenerator::fromSeed() {
+  // The seed is the one of llvm::RandomNumberGenerator, whose option is only
+  // reachable through the registry
+  uint64_t Seed = 0;
+  auto &Options = llvm::cl::getRegisteredOptions();
+  auto Where = Options.find("rng-seed");
+  if (Where != Options.end())
+    Seed = static_cast<llvm::cl::opt<unsigned long long> *>(Where->second)
+               ->getValue();
+  return RandomNumberGenerator(mix(Seed));
+}
+
+RandomNumberGenerator createRNG(llvm::StringRef PassName,
+                                llvm::Function const &F) {
+  llvm::StringRef ModuleName =
+      llvm::sys::path::filename(F.getParent()->getModuleIdentifier());
+  return RandomNumberGenerator::fromSeed()
+      .split(PassName)
+      .split(ModuleName)
+      .split(F.getName());
+}
+}
@@ -0,0 +1,115 @@
+#ifndef LLVMDEMO_DUPLICATEBB_H
+#define LLVMDEMO_DUPLICATEBB_H
+
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/PassManager.h"
+
+#include "FunctionCache.h"
+#include "Utils.h"
+
+#include <string>
+#include <utility>
+
+namespace llvm {
+class BasicBlock;
+class BlockFrequencyInfo;
+class DominatorTree;
+class Instruction;
+class LoopInfo;
+class Value;
+}
+
+class ReachableIntegerValues;
+
+// The duplication of basic blocks, for the new pass manager. The legacy pass
+// shares its implementation.
+class DuplicateBBPass {
+
+public:
+  static llvm::StringRef name() { return "DuplicateBBPass"; }
+
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::AnalysisManager<llvm::Function> *AM);
+
+  // Called once for each module, before the calls on its functions. The
+  // random number generators are salted with PassName, the name of the
+  // legacy pass.
+  void initialize(llvm::Module &M, llvm::StringRef PassName);
+
+  // LI is only needed, and updated, when loops are handled specifically, as
+  // is BFI when profile guidance or a growth budget are enabled
+  bool runOnFunction(llvm::Function &F, ReachableIntegerValues &RIV,
+                     llvm::DominatorTree &DT,
+                     llvm::BlockFrequencyInfo const *BFI, llvm::LoopInfo *LI);
+
+private:
+  // A context value for the duplication of the instructions from Begin on,
+  // picked after -duplicate-bb-context among the integer values reachable
+  // from From, if any: those reachable from its block, and those its block
+  // defines before it. From is Begin, or the first instruction of the loop
+  // header when the condition is hoisted to the preheader.
+  llvm::Value *pickContextValue(llvm::Instruction &Begin,
+                                llvm::Instruction &From,
+                                ReachableIntegerValues const &RIV,
+                                llvm::DominatorTree const &DT);
+
+  // Narrow [Begin, End) to a random window of -duplicate-bb-max-window
+  // instructions, if it holds more
+  void selectWindow(llvm::BasicBlock &BB, llvm::Instruction *&Begin,
+                    llvm::Instruction *&End);
+
+  // Move the instructions of BB from Begin to End, End excluded, to a block
+  // of their own, and return it
+  llvm::BasicBlock *splitWindow(llvm::BasicBlock &BB, llvm::Instruction &Begin,
+                                llvm::Instruction &End,
+                                ReachableIntegerValues &RIV,
+                                llvm::DominatorTree &DT, llvm::LoopInfo *LI);
+
+  struct ClonePair {
+    llvm::Instruction *Then, *Else;
+  };
+
+  // The clones of V, if it is an instruction of Tail already duplicated
+  bool getClones(llvm::Value const *V, llvm::BasicBlock const &Tail,
+                 ClonePair &Pair) const;
+
+  // Make the operands of the clones of an instruction of Tail refer to the
+  // clones of the instructions already duplicated
+  void remapClones(llvm::Instruction &ThenClone, llvm::Instruction &ElseClone,
+                   llvm::BasicBlock const &Tail) const;
+
+  void duplicate(llvm::BasicBlock &BB, llvm::Value *Cond,
+                 ReachableIntegerValues &RIV, llvm::DominatorTree &DT,
+                 llvm::LoopInfo *LI);
+
+  // Each function has its own random number generator
+  std::string PassName;
+  compat::RandomNumberGenerator RNG;
+
+  // The ratio of each function
+  FunctionRatios Ratios;
+
+  // The module the budget belongs to
+  llvm::Module const *M = nullptr;
+
+  FunctionCache Cache;
+
+  // How many instructions we may still add to the module
+  GrowthBudget ModuleBudget;
+
+  // The clones of the instructions of the tail of the block being
+  // duplicated, by position, the positions of these instructions sorted by
+  // address, and the instructions to erase from the tail. They are cleared
+  // after each block, which keeps their storage, reused across blocks and
+  // functions.
+  llvm::SmallVector<ClonePair, 8> Clones;
+  llvm::SmallVector<std::pair<llvm::Instruction const *, unsigned>, 8>
+      Positions;
+  llvm::SmallVector<llvm::Instruction *, 8> ToRemove;
+
+  // What is reported about the current function
+  unsigned FunctionPHICount = 0;
+  FunctionReport Report;
+};
+
+#endif
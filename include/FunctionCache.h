@@ -0,0 +1,46 @@
+#ifndef LLVMDEMO_FUNCTIONCACHE_H
+#define LLVMDEMO_FUNCTIONCACHE_H
+
+#include "llvm/ADT/StringRef.h"
+
+#include <string>
+
+namespace llvm {
+class Function;
+}
+
+// An on-disk cache of obfuscated functions, indexed by a hash of the function
+// before obfuscation, of the options of the pass and of its random numbers.
+// Each entry is a bitcode module holding the obfuscated function, and the
+// declarations of the globals it refers to, which are resolved by name.
+// Functions with debug information, or referring to unnamed globals, are not
+// cached.
+class FunctionCache {
+  std::string Directory;
+  std::string PassName;
+  std::string Options;
+
+public:
+  FunctionCache() = default;
+  // Options should hold the value of each option that changes the output
+  // of the pass
+  FunctionCache(llvm::StringRef Directory, llvm::StringRef PassName,
+                llvm::StringRef Options)
+      : Directory(Directory), PassName(PassName), Options(Options) {}
+
+  bool isEnabled() const { return not Directory.empty(); }
+
+  // The key of F before obfuscation, empty if F cannot be cached.
+  // FunctionOptions holds the options that change from one function to
+  // another.
+  std::string getKey(llvm::Function const &F,
+                     llvm::StringRef FunctionOptions = "") const;
+
+  // Replace the body of F with the one cached under Key, if any
+  bool lookup(llvm::Function &F, llvm::StringRef Key) const;
+
+  // Cache the body of F, obfuscated, under Key
+  void store(llvm::Function const &F, llvm::StringRef Key) const;
+};
+
+#endif
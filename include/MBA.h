@@ -0,0 +1,88 @@
+#ifndef LLVMDEMO_MBA_H
+#define LLVMDEMO_MBA_H
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/IR/PassManager.h"
+
+#include "FunctionCache.h"
+#include "Utils.h"
+
+#include <string>
+#include <utility>
+
+namespace llvm {
+class BasicBlock;
+class BlockFrequencyInfo;
+class TargetTransformInfo;
+class Type;
+}
+
+namespace rules {
+struct RuleInfo;
+}
+
+// The Mixed Boolean Arithmetic substitution, for the new pass manager. The
+// legacy pass shares its implementation.
+class MBAPass {
+
+public:
+  static llvm::StringRef name() { return "MBAPass"; }
+
+  llvm::PreservedAnalyses run(llvm::Function &F,
+                              llvm::AnalysisManager<llvm::Function> *AM);
+
+  // Called once for each module, before the calls on its functions. The
+  // random number generators are salted with PassName, the name of the
+  // legacy pass.
+  void initialize(llvm::Module &M, llvm::StringRef PassName);
+
+  // Called once for each function, before and after the calls on its basic
+  // blocks. Returns true if the function has been read from the cache, in
+  // which case its basic blocks are left as is.
+  bool initialize(llvm::Function &F);
+  void finalize(llvm::Function &F);
+
+  // BFI is only needed for profile guidance
+  bool runOnBasicBlock(llvm::BasicBlock &BB,
+                       llvm::TargetTransformInfo const &TTI,
+                       llvm::BlockFrequencyInfo const *BFI);
+
+private:
+  rules::RuleInfo const *getRule(unsigned Opcode, llvm::Type *Ty);
+
+  // Each function has its own random number generator
+  std::string PassName;
+  compat::RandomNumberGenerator RNG;
+
+  // The module the budget belongs to
+  llvm::Module const *M = nullptr;
+
+  // The cache, and the key of the current function if it can be cached
+  FunctionCache Cache;
+  std::string CacheKey;
+  bool FromCache = false;
+
+  // The rule used for each binary operator and type, selected on first use
+  // in each function as costs depend on the target the function is built
+  // for, so that there is a single rule lookup per operator and type
+  llvm::DenseMap<std::pair<unsigned, llvm::Type *>, rules::RuleInfo const *>
+      SelectedRules;
+  llvm::TargetTransformInfo const *TTI = nullptr;
+
+  // The ratio of each function, and of the current one
+  FunctionRatios Ratios;
+  double FunctionRatio = 1.;
+
+  // Estimated cost added to the current function, and what is reported
+  // about it
+  unsigned FunctionCost = 0;
+  uint64_t FunctionInstructionCount = 0;
+  unsigned FunctionSubstitutionCount = 0;
+  FunctionReport Report;
+
+  // How many instructions we may still add to the module, and to the
+  // current function
+  GrowthBudget ModuleBudget, FunctionBudget;
+};
+
+#endif
@@ -1,21 +1,125 @@
+#ifndef LLVMDEMO_REACHABLEINTEGERVALUES_H
+#define LLVMDEMO_REACHABLEINTEGERVALUES_H
+
 #include "llvm/Pass.h"
-#include "llvm/IR/ValueMap.h"
-#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/IR/Dominators.h"
+#include "llvm/IR/PassManager.h"
+
+#include <memory>
+#include <random>
+#include <vector>
+
+// The integer values reachable from each basic block of a function, computed
+// from its dominator tree
+class ReachableIntegerValues {
+
+public:
+  ReachableIntegerValues(llvm::Function &F, llvm::DominatorTree &DT);
+
+  void print(llvm::raw_ostream &O) const;
+
+  // The dominator tree is used to number the blocks lazily, so both must
+  // be preserved
+  bool invalidate(llvm::Function &, llvm::PreservedAnalyses const &PA);
+
+  // Number of integer values reachable from BB
+  size_t getReachableIntegerValuesCount(llvm::BasicBlock const *BB) const;
+
+  // The Index-th integer value reachable from BB, Index being lower than
+  // getReachableIntegerValuesCount(BB). Values defined by the nearest
+  // dominators come first.
+  llvm::Value *getReachableIntegerValue(llvm::BasicBlock const *BB,
+                                        size_t Index) const;
+
+  // Materialize the whole set of integer values reachable from BB
+  void getReachableIntegerValues(
+      llvm::BasicBlock const *BB,
+      llvm::SmallVectorImpl<llvm::Value *> &ReachableValues) const;
+
+  // Pick a random integer value reachable from BB, if any
+  template <class RNGTy>
+  llvm::Value *getRandomReachableIntegerValue(llvm::BasicBlock const *BB,
+                                              RNGTy &RNG) const {
+    size_t Count = getReachableIntegerValuesCount(BB);
+    if (!Count)
+      return nullptr;
+    std::uniform_int_distribution<size_t> Dist(0, Count - 1);
+    return getReachableIntegerValue(BB, Dist(RNG));
+  }
+
+  // Update API, so that transformations can keep the analysis valid and
+  // declare it preserved. They must keep the dominator tree up to date too,
+  // as blocks that have not been numbered yet are numbered from it.
+  // Values created by the transformation are not taken into account, which
+  // is conservative.
+
+  // Tail has been split from Head and holds its last instructions. Tail now
+  // dominates the blocks Head used to dominate.
+  void splitBlock(llvm::BasicBlock const *Head, llvm::BasicBlock const *Tail);
+
+  // NewBB is a new block, immediately dominated by IDom
+  void addBlock(llvm::BasicBlock const *NewBB, llvm::BasicBlock const *IDom);
+
+  // Old is about to be replaced by New, defined in the same block
+  void replaceValue(llvm::Value *Old, llvm::Value *New);
 
+  // I is about to be erased
+  void removeValue(llvm::Instruction *I);
 
+private:
+  // Integer values are numbered once, and each block of the dominator tree
+  // owns the range of the values it defines, plus a link to its immediate
+  // dominator. The values reachable from a block are the union of the ranges
+  // found along its dominator chain, so nothing is copied from a block to its
+  // children.
+  // In lazy mode, blocks are only numbered when first queried, along with
+  // their dominators, hence the mutable members.
+  struct BlockInfo {
+    unsigned IDom;
+    unsigned Begin, End;
+  };
+  static constexpr unsigned NoBlock = ~0u;
+
+  unsigned getBlockIndex(llvm::BasicBlock const *BB) const;
+  unsigned numberBlock(llvm::DomTreeNode const *Node, unsigned IDom) const;
+
+  llvm::Function const *F;
+  llvm::DominatorTree *DT;
+  mutable std::vector<llvm::Value *> Values;
+  mutable llvm::DenseMap<llvm::Value const *, unsigned> ValueNumbers;
+  mutable std::vector<BlockInfo> Blocks;
+  mutable llvm::DenseMap<llvm::BasicBlock const *, unsigned> BlockIndices;
+};
+
+// The analysis, for the new pass manager
+class ReachableIntegerValuesAnalysis {
+  static char PassID;
+
+public:
+  typedef ReachableIntegerValues Result;
+
+  static void *ID() { return (void *)&PassID; }
+  static llvm::StringRef name() { return "ReachableIntegerValuesAnalysis"; }
+
+  Result run(llvm::Function &F, llvm::AnalysisManager<llvm::Function> *AM);
+};
+
+// The analysis, for the legacy pass manager
 class ReachableIntegerValuesPass : public llvm::FunctionPass {
+  std::unique_ptr<ReachableIntegerValues> RIV;
 
 public:
-  using ReachableIntegerValuesMapTy =
-      llvm::ValueMap<llvm::BasicBlock const *, llvm::SmallPtrSet<llvm::Value *,8>>;
   static char ID;
   ReachableIntegerValuesPass();
 
+  ReachableIntegerValues &getRIV() { return *RIV; }
+
   void getAnalysisUsage(llvm::AnalysisUsage &Info) const override;
   bool runOnFunction(llvm::Function &) override;
-  ReachableIntegerValuesMapTy const &getReachableIntegerValuesMap() const;
+  void releaseMemory() override { RIV.reset(); }
   void print(llvm::raw_ostream &O, llvm::Module const *) const override;
-
-private:
-  ReachableIntegerValuesMapTy ReachableIntegerValuesMap;
 };
+
+#endif
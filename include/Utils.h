@@ -36,28 +36,234 @@ public:
 }
 }
 
+#include <algorithm>
+#include <cstdint>
+
+/* for profile-guided target selection
+ * {
+ */
+namespace llvm {
+class BasicBlock;
+class BlockFrequencyInfo;
+}
+
+// Ratio to apply to BB: blocks whose frequency, relative to the entry block,
+// exceeds HotThreshold are hot and use HotRatio instead, when it is lower.
+// Profile guidance is disabled if BFI is null or HotThreshold is not positive.
+double getBlockRatio(llvm::BasicBlock const &BB,
+                     llvm::BlockFrequencyInfo const *BFI, double Ratio,
+                     double HotThreshold, double HotRatio);
+/* } */
+
+/* for code growth control
+ * {
+ */
+namespace llvm {
+class Function;
+class Module;
+}
+
+uint64_t getInstructionCount(llvm::Function const &F);
+uint64_t getInstructionCount(llvm::Module const &M);
+
+// Number of instructions a pass may still add, given a maximal growth in
+// percent of an initial instruction count. A null growth means no limit.
+class GrowthBudget {
+  uint64_t Remaining;
+  bool Limited;
+
+public:
+  GrowthBudget() : Remaining(0), Limited(false) {}
+  GrowthBudget(uint64_t Count, unsigned MaxGrowth)
+      : Remaining(Count * MaxGrowth / 100), Limited(MaxGrowth != 0) {}
+
+  bool isLimited() const { return Limited; }
+  bool canAfford(uint64_t Growth) const {
+    return not Limited or Growth <= Remaining;
+  }
+  void consume(uint64_t Growth) {
+    if (Limited)
+      Remaining -= std::min(Growth, Remaining);
+  }
+};
+/* } */
+
+/* for per-function reports
+ * {
+ */
+#include "llvm/ADT/ArrayRef.h"
+#include <chrono>
+#include <utility>
+
+// Whether -pass-remarks-analysis selects the remarks of PassName, so that
+// the remarks that are costly to compute are only computed when asked for.
+// clang filters the remarks in its own diagnostic handler, after
+// -Rpass-analysis, which the passes cannot query: there, these remarks also
+// need -mllvm -pass-remarks-analysis=<pass>.
+bool areRemarksEnabled(char const *PassName, llvm::Function const &F);
+
+// What a pass did to a function, emitted as an optimization remark analysis,
+// printed with -pass-remarks-analysis=<pass>. The message is a list of
+// key=value pairs, easy to parse back, ending with the time spent on the
+// function. Every report of a pass has the same keys, those whose value is
+// not known are given as Unknown.
+class FunctionReport {
+  std::chrono::steady_clock::time_point Start;
+
+public:
+  static constexpr uint64_t Unknown = ~uint64_t(0);
+
+  // Called before the pass works on a function
+  void start() { Start = std::chrono::steady_clock::now(); }
+
+  void emit(char const *PassName, llvm::Function const &F,
+            llvm::ArrayRef<std::pair<char const *, uint64_t>> Values) const;
+};
+/* } */
+
+/* for selective obfuscation
+ * {
+ */
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringMap.h"
+#include <memory>
+#include <string>
+#include <vector>
+
+// Ratios of the passes on some functions, read from a policy file given on
+// the command line. Each line holds a glob on function names, where `*' and
+// `?' are wildcards, followed by pass=ratio pairs, the passes being mba and
+// duplicate-bb:
+//
+//   # critical code is left as is
+//   fast_*    mba=0 duplicate-bb=0
+//   crypto_*  mba=1 duplicate-bb=0.5
+//
+// The first line that matches a function and names a pass sets the ratio of
+// the pass on the function. The file is parsed once, into a lookup structure
+// per pass, where names without wildcards are hashed.
+class ObfuscationPolicy {
+  struct Rule {
+    unsigned Line;
+    double Ratio;
+  };
+  struct PassRules {
+    // the first rule for each name without wildcards
+    llvm::StringMap<Rule> Names;
+    // the others, in line order
+    std::vector<std::pair<std::string, Rule>> Globs;
+  };
+  // shared, as options are copied around
+  std::shared_ptr<llvm::StringMap<PassRules> const> Rules;
+
+public:
+  std::string Filename;
+
+  // Reads the policy file, sets Error on failure
+  bool load(llvm::StringRef Filename, std::string &Error);
+
+  // The ratio of Pass on the function Name, if set by the policy
+  bool lookup(llvm::StringRef Pass, llvm::StringRef Name, double &Ratio) const;
+};
+
+namespace llvm {
+namespace cl {
+
+template <>
+class parser<ObfuscationPolicy> : public basic_parser<ObfuscationPolicy> {
+public:
+  parser(Option &O) : basic_parser<ObfuscationPolicy>(O) {}
+  virtual ~parser(){};
+
+  bool parse(Option &O, StringRef ArgName, const std::string &Arg,
+             ObfuscationPolicy &Val);
+
+  void printOptionDiff(const Option &O, ObfuscationPolicy const &V,
+                       OptionValue<ObfuscationPolicy> D,
+                       size_t GlobalWidth) const;
+  void anchor() override {}
+};
+}
+}
+
+// The annotations of the functions of M, as gathered by clang
+void getFunctionAnnotations(
+    llvm::Module const &M,
+    llvm::SmallVectorImpl<std::pair<llvm::Function const *, llvm::StringRef>>
+        &Annotations);
+
+// The ratio of a pass on each function of a module, set, in order of
+// precedence, by an annotation of the function of the form
+//   __attribute__((annotate("obf-<pass>=<ratio>")))
+// by the policy, or by the ratio given on the command line
+class FunctionRatios {
+  llvm::DenseMap<llvm::Function const *, double> Annotated;
+  ObfuscationPolicy const *Policy = nullptr;
+  std::string Pass;
+  double Default = 1.;
+
+public:
+  FunctionRatios() = default;
+  // Invalid annotations are reported through the context of M
+  FunctionRatios(llvm::Module const &M, llvm::StringRef Pass,
+                 ObfuscationPolicy const &Policy, double Default);
+
+  double get(llvm::Function const &F) const;
+};
+/* } */
+
 // The random number generator bundled with LLVM is not compatible with <random>
-// (bug opened!)
-// Provide the relevant wrapper here
-#include "llvm/Support/RandomNumberGenerator.h"
+// (bug opened!), and it is salted with the name of a module, so that the
+// numbers drawn for a function depend on the functions processed before.
+// Provide a compatible one here: a counter-based SplitMix64 generator, whose
+// n-th number only depends on its key and on n. Keys are derived from
+// -rng-seed and from names, so that independent streams are cheap to create,
+// and reproducible from any thread.
+#include "llvm/ADT/StringRef.h"
+#include <random>
 namespace compat {
 
 class RandomNumberGenerator {
-  using generator_type = std::mt19937_64;
-  std::unique_ptr<llvm::RandomNumberGenerator> RNG;
+  uint64_t Key = 0;
+  uint64_t Counter = 0;
+
+  static constexpr uint64_t Gamma = 0x9e3779b97f4a7c15ULL;
+
+  static uint64_t mix(uint64_t Z) {
+    Z = (Z ^ (Z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    Z = (Z ^ (Z >> 27)) * 0x94d049bb133111ebULL;
+    return Z ^ (Z >> 31);
+  }
 
 public:
-  using result_type = generator_type::result_type;
+  using result_type = uint64_t;
   RandomNumberGenerator() = default;
-  RandomNumberGenerator(llvm::RandomNumberGenerator *RNG) : RNG(RNG) {}
+  explicit RandomNumberGenerator(uint64_t Key) : Key(Key) {}
 
-  generator_type::result_type operator()() { return (*RNG)(); }
-  static constexpr generator_type::result_type min() {
-    return generator_type::min();
-  }
-  static constexpr generator_type::result_type max() {
-    return generator_type::max();
+  // The generator keyed by -rng-seed
+  static RandomNumberGenerator fromSeed();
+
+  // An independent generator, keyed by this one's key and Name
+  RandomNumberGenerator split(llvm::StringRef Name) const {
+    uint64_t SubKey = mix(Key ^ Gamma);
+    for (unsigned char C : Name)
+      SubKey = mix(SubKey ^ C);
+    return RandomNumberGenerator(SubKey);
   }
+
+  // The Index-th number of the stream, whatever has been drawn already
+  result_type at(uint64_t Index) const { return mix(Key + Index * Gamma); }
+
+  result_type operator()() { return at(++Counter); }
+  static constexpr result_type min() { return 0; }
+  static constexpr result_type max() { return ~result_type(0); }
 };
+
+// The generator used by the pass PassName on F, keyed by the names of the
+// pass, of the module and of the function, so that functions can be
+// processed in any order, or in parallel
+RandomNumberGenerator createRNG(llvm::StringRef PassName,
+                                llvm::Function const &F);
 }
 #endif